@@ -0,0 +1,152 @@
+/*
+ * Microbenchmark for gamma ramp generation: times the per-entry pow()
+ * loop set_gamma used to run against gamma_ramp(), for three channels
+ * of the ramp sizes hardware reports, and shows how far apart their
+ * results are.
+ *
+ *	gamma_bench [repeat]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "config.h"
+#include "gamma_ramp.h"
+
+static const int sizes[] = { 256, 1024, 4096, 65536 };
+
+static const struct {
+    const char	*name;
+    double	red, green, blue, brightness;
+} cases[] = {
+    { "R=G=B",	    0.8, 0.8, 0.8, 0.9 },
+    { "distinct",   0.8, 1.1, 1.3, 0.9 },
+};
+
+static inline double
+dmin (double x, double y)
+{
+    return x < y ? x : y;
+}
+
+/* the loop set_gamma used before gamma_ramp */
+static void
+old_ramps (unsigned short *red, unsigned short *green, unsigned short *blue,
+	   int size, int shift, double gammaRed, double gammaGreen,
+	   double gammaBlue, double brightness)
+{
+    int	i;
+
+    for (i = 0; i < size; i++) {
+	if (gammaRed == 1.0 && brightness == 1.0)
+	    red[i] = i;
+	else
+	    red[i] = dmin(pow((double)i/(double)(size - 1),
+			      gammaRed) * brightness,
+			  1.0) * (double)(size - 1);
+	red[i] <<= shift;
+
+	if (gammaGreen == 1.0 && brightness == 1.0)
+	    green[i] = i;
+	else
+	    green[i] = dmin(pow((double)i/(double)(size - 1),
+				gammaGreen) * brightness,
+			    1.0) * (double)(size - 1);
+	green[i] <<= shift;
+
+	if (gammaBlue == 1.0 && brightness == 1.0)
+	    blue[i] = i;
+	else
+	    blue[i] = dmin(pow((double)i/(double)(size - 1),
+			       gammaBlue) * brightness,
+			   1.0) * (double)(size - 1);
+	blue[i] <<= shift;
+    }
+}
+
+/* what set_gamma does now */
+static void
+new_ramps (unsigned short *red, unsigned short *green, unsigned short *blue,
+	   int size, int shift, double gammaRed, double gammaGreen,
+	   double gammaBlue, double brightness)
+{
+    gamma_ramp(red, size, shift, gammaRed, brightness);
+    if (gammaGreen == gammaRed)
+	memcpy(green, red, size * sizeof(unsigned short));
+    else
+	gamma_ramp(green, size, shift, gammaGreen, brightness);
+    if (gammaBlue == gammaRed)
+	memcpy(blue, red, size * sizeof(unsigned short));
+    else if (gammaBlue == gammaGreen)
+	memcpy(blue, green, size * sizeof(unsigned short));
+    else
+	gamma_ramp(blue, size, shift, gammaBlue, brightness);
+}
+
+static double
+now_us (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int
+main (int argc, char **argv)
+{
+    int		    repeat = argc > 1 ? atoi (argv[1]) : 0;
+    int		    s, c, r, i, n, shift, diff, maxdiff;
+    double	    start, old_us, new_us;
+    unsigned short  *old, *new;
+
+    old = malloc (3 * 65536 * sizeof (unsigned short));
+    new = malloc (3 * 65536 * sizeof (unsigned short));
+    if (!old || !new)
+	return 1;
+
+    printf ("%-8s %6s %12s %12s %8s %10s\n", "case", "size",
+	    "old us", "new us", "speedup", "max diff");
+    for (c = 0; c < (int) (sizeof (cases) / sizeof (cases[0])); c++)
+    {
+	double	red = 1.0 / cases[c].red;
+	double	green = 1.0 / cases[c].green;
+	double	blue = 1.0 / cases[c].blue;
+	double	brightness = cases[c].brightness;
+
+	for (s = 0; s < (int) (sizeof (sizes) / sizeof (sizes[0])); s++)
+	{
+	    n = sizes[s];
+	    shift = 16 - (ffs (n) - 1);
+	    /* about the same amount of work for every size */
+	    r = repeat > 0 ? repeat : 4 * 65536 / n;
+
+	    start = now_us ();
+	    for (i = 0; i < r; i++)
+		old_ramps (old, old + n, old + 2 * n, n, shift,
+			   red, green, blue, brightness);
+	    old_us = (now_us () - start) / r;
+
+	    start = now_us ();
+	    for (i = 0; i < r; i++)
+		new_ramps (new, new + n, new + 2 * n, n, shift,
+			   red, green, blue, brightness);
+	    new_us = (now_us () - start) / r;
+
+	    /* in steps of the hardware table */
+	    maxdiff = 0;
+	    for (i = 0; i < 3 * n; i++)
+	    {
+		diff = abs ((old[i] >> shift) - (new[i] >> shift));
+		if (diff > maxdiff)
+		    maxdiff = diff;
+	    }
+	    printf ("%-8s %6d %12.1f %12.1f %7.1fx %10d\n", cases[c].name, n,
+		    old_us, new_us, old_us / new_us, maxdiff);
+	}
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * Gamma ramp generation, shared by xrandr and the gamma_bench
+ * microbenchmark
+ */
+
+#ifndef _GAMMA_RAMP_H_
+#define _GAMMA_RAMP_H_
+
+#include <stdint.h>
+#include <math.h>
+
+/*
+ * pow (x, e) for 0 < x <= 1, without library calls, branches or
+ * integer conversions so that the ramp loop below can be vectorized.
+ * log2 of the mantissa comes from the odd series in (m - 1) / (m + 1)
+ * and 2^y from a Taylor polynomial around the nearest integer; the
+ * integer parts move in and out of the exponent bits by adding 2^52,
+ * which needs e * log2 (x) > -1022. The relative error is below
+ * 2e-7 * (e + 1), a small fraction of one step of a 16-bit ramp
+ */
+/*
+ * gcc before 12 does not vectorize at -O2, and 12's "very cheap" cost
+ * model at -O2 refuses the loops below since their trip count is not
+ * known; ask for the vectorizer and its full cost model for them.
+ * clang vectorizes them at -O2 as is
+ */
+#if defined(__GNUC__) && !defined(__clang__)
+#define GAMMA_RAMP_VECTORIZE \
+    __attribute__((optimize ("tree-vectorize", "vect-cost-model=dynamic")))
+#else
+#define GAMMA_RAMP_VECTORIZE
+#endif
+
+#define POW_UNIT_MAGIC	4503599627370496.0	/* 2^52 */
+
+static inline double
+pow_unit (double x, double e)
+{
+    union { double d; uint64_t u; } v, w;
+    double  k, m, t, t2, y, n, f, p;
+
+    /* x = m * 2^k with m in [1, 2) */
+    v.d = x;
+    w.u = (v.u >> 52) | 0x4330000000000000ULL;
+    k = w.d - (POW_UNIT_MAGIC + 1023.0);
+    v.u = (v.u & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+    m = v.d;
+    t = (m - 1.0) / (m + 1.0);
+    t2 = t * t;
+    y = k + 2.8853900817779268 * t *
+	(1.0 + t2 * (1/3.0 + t2 * (1/5.0 + t2 * (1/7.0 + t2 * (1/9.0 + t2 * (1/11.0))))));
+
+    /* 2^y = 2^n * 2^f with n an integer and |f| <= 1/2 */
+    y *= e;
+    w.d = y + (POW_UNIT_MAGIC + 1023.0);
+    n = w.d - (POW_UNIT_MAGIC + 1023.0);
+    f = (y - n) * 0.69314718055994531;
+    p = 1.0 + f * (1.0 + f * (1/2.0 + f * (1/6.0 + f * (1/24.0 +
+	f * (1/120.0 + f * (1/720.0 + f * (1/5040.0)))))));
+    v.u = w.u << 52;
+    return p * v.d;
+}
+
+/*
+ * Fill one channel: ramp[i] = (i / (size - 1))^exponent * brightness,
+ * clamped to 1 and scaled to [0, size), then shifted into the MSBs.
+ * The clamp is done on integers; floating point compares keep the
+ * compiler from vectorizing the loops
+ */
+static void GAMMA_RAMP_VECTORIZE
+gamma_ramp (unsigned short *ramp, int size, int shift,
+	    double exponent, double brightness)
+{
+    double  scale = (double) (size - 1);
+    double  step = 1.0 / scale;
+    double  d;
+    int	    last = size - 1;
+    int	    i, v;
+
+    if (exponent == 1.0 && brightness == 1.0)
+    {
+	for (i = 0; i < size; i++)
+	    ramp[i] = i << shift;
+	return;
+    }
+    /*
+     * Outside the range of pow_unit or of the integer clamp; this
+     * includes the first entry of non-positive exponents
+     */
+    if (exponent <= 0.0 || exponent > 60.0 ||
+	brightness < 0.0 || brightness > 256.0)
+    {
+	for (i = 0; i < size; i++)
+	{
+	    d = pow (i * step, exponent) * brightness;
+	    ramp[i] = (unsigned short) ((d < 1.0 ? d : 1.0) * scale) << shift;
+	}
+	return;
+    }
+    ramp[0] = 0;
+    if (exponent == 1.0)
+    {
+	for (i = 1; i < size; i++)
+	{
+	    v = i / scale * brightness * scale;
+	    ramp[i] = (v < last ? v : last) << shift;
+	}
+	return;
+    }
+    for (i = 1; i < size; i++)
+    {
+	v = pow_unit (i * step, exponent) * brightness * scale;
+	ramp[i] = (v < last ? v : last) << shift;
+    }
+}
+
+#endif /* _GAMMA_RAMP_H_ */
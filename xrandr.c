@@ -31,6 +31,7 @@
 #include <X11/Xproto.h>
 #include <X11/Xatom.h>
 #include <X11/extensions/Xrandr.h>
+#include <X11/extensions/randrproto.h>
 #include <X11/extensions/Xrender.h>	/* we share subpixel information */
 #include <strings.h>
 #include <string.h>
@@ -38,9 +39,17 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <utime.h>
 
 #include "config.h"
+#include "gamma_ramp.h"
 
 static char	*program_name;
 static Display	*dpy;
@@ -51,7 +60,13 @@ static Bool	automatic = False;
 static Bool	properties = False;
 static Bool	providers = False;
 static Bool	grab_server = True;
+static Bool	optimistic = False;
+static Bool	last_good = False;	/* save it before the first change */
+static int	settle_timeout = 0;	/* ms to wait for notifications */
+static int	fade_duration = 0;	/* ms to fade gamma changes over */
+static int	fade_rate = 60;		/* fade steps per second */
 static Bool	no_primary = False;
+static Bool	prefer_low_clock = False;
 
 static const char *direction[5] = {
     "normal", 
@@ -112,16 +127,36 @@ usage(void)
     fprintf(stderr, "  --current\n");
     fprintf(stderr, "  --dryrun\n");
     fprintf(stderr, "  --nograb\n");
+    fprintf(stderr, "  --optimistic\n");
+    fprintf(stderr, "  --wait-settle[=<timeout ms>]\n");
+    fprintf(stderr, "  --fade <duration ms>\n");
+    fprintf(stderr, "  --fade-rate <steps per second>\n");
+    fprintf(stderr, "  --simulate <snapshot>\n");
+    fprintf(stderr, "  --dump-snapshot <file>\n");
+    fprintf(stderr, "  --plan-out <file>\n");
+    fprintf(stderr, "  --apply-plan <file>\n");
+    fprintf(stderr, "  --plan-cache\n");
+    fprintf(stderr, "  --save-last-good\n");
+    fprintf(stderr, "  --restore-last-good\n");
+    fprintf(stderr, "  --prefer-low-clock\n");
+    fprintf(stderr, "  --filter-policy auto|nearest|bilinear\n");
     fprintf(stderr, "  --prop or --properties\n");
     fprintf(stderr, "  --fb <width>x<height>\n");
     fprintf(stderr, "  --fbmm <width>x<height>\n");
+    fprintf(stderr, "  --max-fb-bytes <bytes>[K|M|G]\n");
     fprintf(stderr, "  --dpi <dpi>/<output>\n");
+    fprintf(stderr, "  --layout grid:<cols>x<rows>[:bezel=<h>,<v>] <output>,...\n");
+    fprintf(stderr, "  --layout row[:bezel=<h>]|column[:bezel=<v>] <output>,...\n");
+    fprintf(stderr, "  --auto-scale <dpi>\n");
+    fprintf(stderr, "  --bandwidth-budget <file>\n");
+    fprintf(stderr, "  --fit-bandwidth\n");
     fprintf(stderr, "  --output <output>\n");
     fprintf(stderr, "      --auto\n");
     fprintf(stderr, "      --mode <mode>\n");
     fprintf(stderr, "      --preferred\n");
     fprintf(stderr, "      --pos <x>x<y>\n");
     fprintf(stderr, "      --rate <rate> or --refresh <rate>\n");
+    fprintf(stderr, "      --rate max[:<cap>] or --max-refresh\n");
     fprintf(stderr, "      --reflect normal,x,y,xy\n");
     fprintf(stderr, "      --rotate normal,inverted,left,right\n");
     fprintf(stderr, "      --left-of <output>\n");
@@ -133,10 +168,12 @@ usage(void)
     fprintf(stderr, "      --scale <x>x<y>\n");
     fprintf(stderr, "      --scale-from <w>x<h>\n");
     fprintf(stderr, "      --transform <a>,<b>,<c>,<d>,<e>,<f>,<g>,<h>,<i>\n");
+    fprintf(stderr, "      --keystone <x1>,<y1>:<x2>,<y2>:<x3>,<y3>:<x4>,<y4>\n");
     fprintf(stderr, "      --off\n");
     fprintf(stderr, "      --crtc <crtc>\n");
     fprintf(stderr, "      --panning <w>x<h>[+<x>+<y>[/<track:w>x<h>+<x>+<y>[/<border:l>/<t>/<r>/<b>]]]\n");
     fprintf(stderr, "      --gamma <r>:<g>:<b>\n");
+    fprintf(stderr, "      --color-temp <kelvin>[:<brightness>]\n");
     fprintf(stderr, "      --primary\n");
     fprintf(stderr, "  --noprimary\n");
     fprintf(stderr, "  --newmode <name> <clock MHz>\n");
@@ -232,6 +269,25 @@ capability_name (int cap_bit)
     return "invalid capability";
 }
 
+typedef enum _layout {
+    layout_none,
+    layout_grid,
+    layout_row,
+    layout_column,
+} layout_t;
+
+typedef enum _filter_policy {
+    filter_policy_bilinear,
+    filter_policy_nearest,
+    filter_policy_auto,
+} filter_policy_t;
+
+typedef enum _budget_kind {
+    budget_total,
+    budget_link,
+    budget_provider,
+} budget_kind_t;
+
 typedef enum _relation {
     relation_left_of,
     relation_right_of,
@@ -289,6 +345,19 @@ typedef struct _output	output_t;
 typedef struct _transform transform_t;
 typedef struct _umode	umode_t;
 typedef struct _output_prop output_prop_t;
+typedef struct _budget	budget_t;
+typedef struct _tile	tile_t;
+typedef struct _snapshot_crtc snapshot_crtc_t;
+typedef struct _snapshot_output snapshot_output_t;
+
+/* contents of the TILE output property */
+struct _tile {
+    int		    group;
+    int		    flags;
+    int		    num_h, num_v;
+    int		    h_loc, v_loc;
+    int		    width, height;
+};
 
 struct _transform {
     XTransform	    transform;
@@ -310,6 +379,11 @@ struct _crtc {
     output_t	    **outputs;
     int		    noutput;
     transform_t	    current_transform, pending_transform;
+    XRRPanning	    *current_panning;
+    int		    gamma_size;		/* 0 until asked for */
+    XRRCrtcGamma    *gamma;		/* ramp set by set_gamma */
+    XRRCrtcGamma    *fade_from;		/* ramp a --fade starts from */
+    XRRCrtcGamma    *plan_gamma;	/* exact ramp read from a plan */
 };
 
 struct _output_prop {
@@ -348,6 +422,8 @@ struct _output {
 
     Bool    	    automatic;
     int     	    scale_from_w, scale_from_h;
+    Bool	    keystone;
+    double	    keystone_x[4], keystone_y[4];
     transform_t	    transform;
 
     struct {
@@ -357,12 +433,54 @@ struct _output {
     } gamma;
 
     float	    brightness;
+    Bool	    brightness_set;	/* else --color-temp keeps the crtc's */
+    float	    color_temp;		/* kelvin, 0 for none */
 
     Bool	    primary;
 
+    int		    bpc;
+    char	    *path;
+
+    Bool	    max_refresh;
+    double	    refresh_cap;
+
+    /* tile group pseudo outputs: the tiles, row by row */
+    output_t	    **tiles;
+    Bool	    *tiles_on;		/* enabled by the change */
+    int		    tiles_h, tiles_v;
+
     Bool	    found;
 };
 
+struct _budget {
+    struct _budget  *next;
+
+    budget_kind_t   kind;
+    const char	    *name;
+    double	    limit;	/* bits per second */
+
+    char	    **outputs;	/* budget_link: output names or mst:<id> */
+    int		    noutput;
+
+    RROutput	    *provider_outputs;
+    int		    nprovider_output;
+};
+
+/* server state loaded by --simulate */
+struct _snapshot_crtc {
+    XRRCrtcInfo	    info;
+    XRRPanning	    panning;
+    transform_t	    transform;
+    int		    gamma_size;
+};
+
+struct _snapshot_output {
+    XRROutputInfo   info;
+    tile_t	    tile;
+    int		    bpc;
+    char	    *path;
+};
+
 typedef enum _umode_action {
     umode_create, umode_destroy, umode_add, umode_delete
 } umode_action_t;
@@ -409,7 +527,26 @@ static Bool	dryrun = False;
 static int	minWidth, maxWidth, minHeight, maxHeight;
 static Bool    	has_1_2 = False;
 static Bool    	has_1_3 = False;
+static Bool    	has_1_4 = False;
 static int      provider_xid, output_source_provider_xid, offload_sink_provider_xid;
+static layout_t	layout = layout_none;
+static int	layout_columns, layout_rows;
+static int	layout_bezel_x, layout_bezel_y;
+static output_t	**layout_outputs;
+static int	layout_noutput;
+static budget_t	*budgets;
+static Bool	fit_bandwidth = False;
+static double	auto_scale_dpi = 0;
+static double	max_fb_bytes = 0;
+static filter_policy_t filter_policy = filter_policy_bilinear;
+static int	screen_width, screen_height;
+static int	screen_width_mm, screen_height_mm;
+static char	*simulate_file = NULL;
+static snapshot_crtc_t	    **snapshot_crtcs;
+static snapshot_output_t    **snapshot_outputs;
+static RROutput	snapshot_primary = None;
+static int	snapshot_bpp = 32, snapshot_pad = 32;
+static Bool	plan_cache = False;
 
 static int
 mode_height (XRRModeInfo *mode_info, Rotation rotation)
@@ -654,6 +791,157 @@ equal_transform (transform_t *a, transform_t *b)
     return True;
 }
 
+static Bool
+transform_is_identity (XTransform *transform)
+{
+    int	x, y;
+
+    for (y = 0; y < 3; y++)
+	for (x = 0; x < 3; x++)
+	    if (transform->matrix[y][x] != (x == y ? XDoubleToFixed (1.0) : 0))
+		return False;
+    return True;
+}
+
+/* whether 'v' is an integer or the reciprocal of one */
+static Bool
+exact_ratio (double v)
+{
+    v = fabs (v);
+    if (v == 0 || v == floor (v))
+	return True;
+    return fabs (1 / v - floor (1 / v + 0.5)) < 1e-3;
+}
+
+/*
+ * A transform made only of integer (or integer reciprocal) scaling,
+ * 90 degree rotations and reflections, and integer translations maps
+ * pixel centers onto pixel centers, so filtering it is wasted work
+ */
+static Bool
+transform_is_exact (XTransform *transform)
+{
+    int	x, y;
+
+    if (transform->matrix[2][0] != 0 || transform->matrix[2][1] != 0 ||
+	transform->matrix[2][2] != XDoubleToFixed (1.0))
+	return False;
+    for (y = 0; y < 2; y++)
+    {
+	for (x = 0; x < 2; x++)
+	    if (!exact_ratio (XFixedToDouble (transform->matrix[y][x])))
+		return False;
+	if (transform->matrix[y][2] & 0xffff)
+	    return False;
+    }
+    /* no shearing: each row and column has a single non-zero factor */
+    if ((transform->matrix[0][0] != 0) == (transform->matrix[0][1] != 0) ||
+	(transform->matrix[0][0] != 0) == (transform->matrix[1][0] != 0) ||
+	(transform->matrix[1][1] != 0) != (transform->matrix[0][0] != 0) ||
+	(transform->matrix[1][0] != 0) == (transform->matrix[1][1] != 0))
+	return False;
+    return True;
+}
+
+/*
+ * Apply --filter-policy to a transform set with --scale, --scale-from,
+ * --transform or --auto-scale; 'filter' is the one picked by the option
+ */
+static const char *
+transform_filter (XTransform *transform, const char *filter)
+{
+    switch (filter_policy) {
+    case filter_policy_nearest:
+	return "nearest";
+    case filter_policy_auto:
+	return transform_is_exact (transform) ? "nearest" : "bilinear";
+    case filter_policy_bilinear:
+	break;
+    }
+    return filter;
+}
+
+/*
+ * Compute the transform which shows the whole w x h output image inside
+ * the quadrilateral q (top-left, top-right, bottom-right, bottom-left
+ * corners in output pixels). First find the projective matrix m mapping
+ * the rectangle onto q: with m22 = 1, m [0 0 1] = q0 gives m02 and m12,
+ * and the remaining corners give
+ *
+ *   m00 = m20 * q1x + (q1x - q0x) / w	m10 = m20 * q1y + (q1y - q0y) / w
+ *   m01 = m21 * q3x + (q3x - q0x) / h	m11 = m21 * q3y + (q3y - q0y) / h
+ *
+ * where substituting into the q2 equations leaves a linear equation in
+ * m21, and then one in m20. The crtc transform maps output pixels to
+ * screen pixels, which is the inverse of m.
+ */
+static Bool
+keystone_transform (double *qx, double *qy, double w, double h,
+		    XTransform *transform)
+{
+    double  m[3][3], r[3][3];
+    double  a, b, det, max;
+    int	    i, j;
+    static const int	ai[3] = { 2, 2, 1 };
+    static const int	bi[3] = { 1, 0, 0 };
+
+    m[0][2] = qx[0];
+    m[1][2] = qy[0];
+    m[2][2] = 1;
+
+    a = ((qx[2] - qx[3]) * (qy[1] - qy[2]) - (qy[2] - qy[3]) * (qx[1] - qx[2])) * h;
+    b = (qx[2] - qx[1] - qx[3] + qx[0]) * (qy[1] - qy[2]) -
+	(qy[2] - qy[1] - qy[3] + qy[0]) * (qx[1] - qx[2]);
+    if (a == 0)
+	return False;
+    m[2][1] = -b / a;
+
+    if (qx[1] != qx[2])
+	m[2][0] = (m[2][1] * (qx[2] - qx[3]) * h + qx[2] - qx[1] - qx[3] + qx[0]) /
+		  ((qx[1] - qx[2]) * w);
+    else if (qy[1] != qy[2])
+	m[2][0] = (m[2][1] * (qy[2] - qy[3]) * h + qy[2] - qy[1] - qy[3] + qy[0]) /
+		  ((qy[1] - qy[2]) * w);
+    else
+	return False;
+
+    m[0][0] = m[2][0] * qx[1] + (qx[1] - qx[0]) / w;
+    m[1][0] = m[2][0] * qy[1] + (qy[1] - qy[0]) / w;
+    m[0][1] = m[2][1] * qx[3] + (qx[3] - qx[0]) / h;
+    m[1][1] = m[2][1] * qy[3] + (qy[3] - qy[0]) / h;
+
+    /* invert by cofactors */
+    det = 0;
+    for (i = 0; i < 3; i++)
+    {
+	double	p = m[i][0] * (m[ai[i]][2] * m[bi[i]][1] - m[ai[i]][1] * m[bi[i]][2]);
+
+	det += i == 1 ? -p : p;
+    }
+    if (det == 0)
+	return False;
+    max = 0;
+    for (j = 0; j < 3; j++)
+	for (i = 0; i < 3; i++)
+	{
+	    double  p = m[ai[i]][ai[j]] * m[bi[i]][bi[j]] -
+			m[ai[i]][bi[j]] * m[bi[i]][ai[j]];
+
+	    r[j][i] = (((i + j) & 1) ? -p : p) / det;
+	    if (fabs (r[j][i]) > max)
+		max = fabs (r[j][i]);
+	}
+
+    /*
+     * The matrix is homogeneous, so scale it up to make the best use
+     * of the 16.16 fixed point precision
+     */
+    for (j = 0; j < 3; j++)
+	for (i = 0; i < 3; i++)
+	    transform->matrix[j][i] = XDoubleToFixed (r[j][i] * 16384 / max);
+    return True;
+}
+
 static output_t *
 add_output (void)
 {
@@ -796,6 +1084,94 @@ find_mode_by_name (char *name)
 }
 #endif
 
+/*
+ * Among the modes of the output with the same size and (nearly) the
+ * same refresh rate as 'mode', pick the one with the lowest pixel
+ * clock. Monitors often offer both regular and reduced blanking
+ * timings, and the latter leave more room on the link and the PLLs
+ */
+static XRRModeInfo *
+lowest_clock_mode (output_t *output, XRRModeInfo *mode)
+{
+    XRROutputInfo   *output_info = output->output_info;
+    XRRModeInfo	    *best = mode;
+    int		    m;
+
+    if (!mode)
+	return NULL;
+    for (m = 0; m < output_info->nmode; m++)
+    {
+	XRRModeInfo *other = find_mode_by_xid (output_info->modes[m]);
+
+	if (!other || other->width != mode->width ||
+	    other->height != mode->height)
+	    continue;
+	if ((other->modeFlags & (RR_Interlace|RR_DoubleScan)) !=
+	    (mode->modeFlags & (RR_Interlace|RR_DoubleScan)))
+	    continue;
+	if (fabs (mode_refresh (other) - mode_refresh (mode)) >= 0.5)
+	    continue;
+	if (other->dotClock < best->dotClock)
+	    best = other;
+    }
+    if (verbose && best != mode)
+	printf ("output %s: %s (0x%x) %.1fMHz instead of %s (0x%x) %.1fMHz, "
+		"lowest pixel clock for %dx%d at %.1fHz\n",
+		output->output.string,
+		best->name, (int)best->id, (double)best->dotClock / 1000000.0,
+		mode->name, (int)mode->id, (double)mode->dotClock / 1000000.0,
+		mode->width, mode->height, mode_refresh (mode));
+    return best;
+}
+
+/*
+ * Among the modes of the output with the same size as 'mode', pick the
+ * progressive one with the highest refresh rate, not going above the
+ * cap given with --rate max:<cap>
+ */
+static XRRModeInfo *
+max_refresh_mode (output_t *output, XRRModeInfo *mode)
+{
+    XRROutputInfo   *output_info = output->output_info;
+    XRRModeInfo	    *best = NULL;
+    int		    m;
+
+    if (!mode)
+	return NULL;
+    for (m = 0; m < output_info->nmode; m++)
+    {
+	XRRModeInfo *other = find_mode_by_xid (output_info->modes[m]);
+
+	if (!other || other->width != mode->width ||
+	    other->height != mode->height)
+	    continue;
+	if (other->modeFlags & (RR_Interlace|RR_DoubleScan))
+	    continue;
+	if (output->refresh_cap &&
+	    mode_refresh (other) > output->refresh_cap + 0.05)
+	    continue;
+	if (!best || mode_refresh (other) > mode_refresh (best))
+	    best = other;
+    }
+    if (!best)
+    {
+	if (output->refresh_cap &&
+	    mode_refresh (mode) > output->refresh_cap + 0.05)
+	    fatal ("output %s has no %dx%d mode at or below %gHz\n",
+		   output->output.string, mode->width, mode->height,
+		   output->refresh_cap);
+	return mode;
+    }
+    if (verbose && best != mode)
+	printf ("output %s: %s (0x%x) %.1fHz instead of %s (0x%x) %.1fHz, "
+		"highest refresh rate for %dx%d\n",
+		output->output.string,
+		best->name, (int)best->id, mode_refresh (best),
+		mode->name, (int)mode->id, mode_refresh (mode),
+		mode->width, mode->height);
+    return best;
+}
+
 static
 XRRModeInfo *
 find_mode_for_output (output_t *output, name_t *name)
@@ -835,6 +1211,9 @@ find_mode_for_output (output_t *output, name_t *name)
 	    }
 	}
     }
+    /* an explicitly requested mode is used as is, whatever its clock */
+    if (output->max_refresh)
+	best = max_refresh_mode (output, best);
     return best;
 }
 
@@ -856,10 +1235,10 @@ preferred_mode (output_t *output)
 	if (m < output_info->npreferred)
 	    dist = 0;
 	else if (output_info->mm_height)
-	    dist = (1000 * DisplayHeight(dpy, screen) / DisplayHeightMM(dpy, screen) -
+	    dist = (1000 * screen_height / screen_height_mm -
 		    1000 * mode_info->height / output_info->mm_height);
 	else
-	    dist = DisplayHeight(dpy, screen) - mode_info->height;
+	    dist = screen_height - mode_info->height;
 
         if (dist < 0) dist = -dist;
 	if (!best || dist < bestDist)
@@ -868,6 +1247,10 @@ preferred_mode (output_t *output)
 	    bestDist = dist;
 	}
     }
+    if (output->max_refresh)
+	best = max_refresh_mode (output, best);
+    if (prefer_low_clock)
+	best = lowest_clock_mode (output, best);
     return best;
 }
 
@@ -965,11 +1348,383 @@ output_can_use_rotation (output_t *output, Rotation rotation)
     return True;
 }
 
+/*
+ * Snapshots hold everything the planner reads from the server, so that
+ * --simulate can run it without a display. One object per line, lists
+ * of XIDs follow the object they belong to:
+ *
+ *	version major minor
+ *	screen width height width_mm height_mm
+ *	limits min_width min_height max_width max_height
+ *	pixmap bits_per_pixel scanline_pad
+ *	timestamp timestamp config_timestamp
+ *	mode id width height clock hsyncstart hsyncend htotal hskew
+ *	     vsyncstart vsyncend vtotal flags name
+ *	crtc id x y width height mode rotation rotations gamma_size
+ *	crtc-outputs id output...
+ *	crtc-possible id output...
+ *	crtc-panning id left top width height track_left track_top
+ *		     track_width track_height border_left border_top
+ *		     border_right border_bottom
+ *	crtc-transform id m00 m01 m02 m10 m11 m12 m20 m21 m22 filter
+ *	output id connection width_mm height_mm subpixel crtc npreferred name
+ *	output-crtcs id crtc...
+ *	output-clones id output...
+ *	output-modes id mode...
+ *	output-tile id group flags num_h num_v h_loc v_loc width height
+ *	output-bpc id bpc
+ *	output-path id path
+ *	primary id
+ *
+ * Gamma ramps are not recorded, simulated crtcs have linear ones.
+ */
+static snapshot_crtc_t *
+snapshot_crtc (RRCrtc crtc)
+{
+    int	c;
+
+    for (c = 0; c < res->ncrtc; c++)
+	if (res->crtcs[c] == crtc)
+	    return snapshot_crtcs[c];
+    fatal ("snapshot has no crtc 0x%x\n", crtc);
+    return NULL;
+}
+
+static snapshot_output_t *
+snapshot_output (RROutput output)
+{
+    int	o;
+
+    for (o = 0; o < res->noutput; o++)
+	if (res->outputs[o] == output)
+	    return snapshot_outputs[o];
+    fatal ("snapshot has no output 0x%x\n", output);
+    return NULL;
+}
+
+static int
+read_xids (char *s, XID **xids)
+{
+    int	    n = 0;
+    char    *end;
+
+    *xids = NULL;
+    for (;;)
+    {
+	XID xid = strtoul (s, &end, 16);
+
+	if (end == s)
+	    break;
+	*xids = realloc (*xids, (n + 1) * sizeof (XID));
+	if (!*xids) fatal ("out of memory\n");
+	(*xids)[n++] = xid;
+	s = end;
+    }
+    while (*s == ' ' || *s == '\t')
+	s++;
+    return *s ? -1 : n;
+}
+
+static void
+read_snapshot (char *file, int *major, int *minor)
+{
+    FILE    *f = fopen (file, "r");
+    char    line[8192];
+    int	    lineno = 0;
+
+    if (!f)
+	fatal ("cannot open snapshot %s\n", file);
+    res = calloc (1, sizeof (XRRScreenResources));
+    if (!res) fatal ("out of memory\n");
+    *major = 1;
+    *minor = 2;
+    while (fgets (line, sizeof (line), f))
+    {
+	char	key[32];
+	char	*rest;
+	XID	id;
+	int	n, m, ok;
+
+	lineno++;
+	line[strcspn (line, "\n")] = '\0';
+	if (sscanf (line, "%31s %n", key, &n) != 1 || key[0] == '#')
+	    continue;
+	rest = line + n;
+	if (!strcmp (key, "version"))
+	    ok = sscanf (rest, "%d %d", major, minor) == 2;
+	else if (!strcmp (key, "screen"))
+	    ok = sscanf (rest, "%d %d %d %d", &screen_width, &screen_height,
+			 &screen_width_mm, &screen_height_mm) == 4;
+	else if (!strcmp (key, "limits"))
+	    ok = sscanf (rest, "%d %d %d %d", &minWidth, &minHeight,
+			 &maxWidth, &maxHeight) == 4;
+	else if (!strcmp (key, "pixmap"))
+	    ok = sscanf (rest, "%d %d", &snapshot_bpp, &snapshot_pad) == 2 &&
+		 snapshot_bpp > 0 && snapshot_pad >= 8;
+	else if (!strcmp (key, "timestamp"))
+	    ok = sscanf (rest, "%lu %lu", &res->timestamp,
+			 &res->configTimestamp) == 2;
+	else if (!strcmp (key, "mode"))
+	{
+	    XRRModeInfo	*mode;
+
+	    res->modes = realloc (res->modes, (res->nmode + 1) * sizeof (XRRModeInfo));
+	    if (!res->modes) fatal ("out of memory\n");
+	    mode = &res->modes[res->nmode];
+	    ok = sscanf (rest, "%lx %u %u %lu %u %u %u %u %u %u %u %lx %n",
+			 &mode->id, &mode->width, &mode->height,
+			 &mode->dotClock, &mode->hSyncStart, &mode->hSyncEnd,
+			 &mode->hTotal, &mode->hSkew, &mode->vSyncStart,
+			 &mode->vSyncEnd, &mode->vTotal, &mode->modeFlags,
+			 &m) == 12;
+	    if (ok)
+	    {
+		mode->name = strdup (rest + m);
+		mode->nameLength = strlen (rest + m);
+		res->nmode++;
+	    }
+	}
+	else if (!strcmp (key, "crtc"))
+	{
+	    snapshot_crtc_t *crtc = calloc (1, sizeof (snapshot_crtc_t));
+
+	    if (!crtc) fatal ("out of memory\n");
+	    ok = sscanf (rest, "%lx %d %d %u %u %lx %hu %hu %d", &id,
+			 &crtc->info.x, &crtc->info.y,
+			 &crtc->info.width, &crtc->info.height,
+			 &crtc->info.mode, &crtc->info.rotation,
+			 &crtc->info.rotations, &crtc->gamma_size) == 9;
+	    if (ok)
+	    {
+		crtc->info.timestamp = res->timestamp;
+		init_transform (&crtc->transform);
+		res->crtcs = realloc (res->crtcs, (res->ncrtc + 1) * sizeof (RRCrtc));
+		snapshot_crtcs = realloc (snapshot_crtcs, (res->ncrtc + 1) * sizeof (snapshot_crtc_t *));
+		if (!res->crtcs || !snapshot_crtcs) fatal ("out of memory\n");
+		res->crtcs[res->ncrtc] = id;
+		snapshot_crtcs[res->ncrtc++] = crtc;
+	    }
+	}
+	else if (!strcmp (key, "crtc-outputs") || !strcmp (key, "crtc-possible"))
+	{
+	    ok = sscanf (rest, "%lx%n", &id, &m) == 1;
+	    if (ok)
+	    {
+		XRRCrtcInfo *info = &snapshot_crtc (id)->info;
+
+		if (key[5] == 'o')
+		    ok = (info->noutput = read_xids (rest + m, &info->outputs)) >= 0;
+		else
+		    ok = (info->npossible = read_xids (rest + m, &info->possible)) >= 0;
+	    }
+	}
+	else if (!strcmp (key, "crtc-panning"))
+	{
+	    XRRPanning	p;
+
+	    ok = sscanf (rest, "%lx %u %u %u %u %u %u %u %u %d %d %d %d", &id,
+			 &p.left, &p.top, &p.width, &p.height,
+			 &p.track_left, &p.track_top,
+			 &p.track_width, &p.track_height,
+			 &p.border_left, &p.border_top,
+			 &p.border_right, &p.border_bottom) == 13;
+	    if (ok)
+	    {
+		p.timestamp = res->timestamp;
+		snapshot_crtc (id)->panning = p;
+	    }
+	}
+	else if (!strcmp (key, "crtc-transform"))
+	{
+	    XTransform	t;
+
+	    ok = sscanf (rest, "%lx %d %d %d %d %d %d %d %d %d %n", &id,
+			 &t.matrix[0][0], &t.matrix[0][1], &t.matrix[0][2],
+			 &t.matrix[1][0], &t.matrix[1][1], &t.matrix[1][2],
+			 &t.matrix[2][0], &t.matrix[2][1], &t.matrix[2][2],
+			 &m) == 10;
+	    if (ok)
+		set_transform (&snapshot_crtc (id)->transform, &t, rest + m,
+			       NULL, 0);
+	}
+	else if (!strcmp (key, "output"))
+	{
+	    snapshot_output_t	*output = calloc (1, sizeof (snapshot_output_t));
+
+	    if (!output) fatal ("out of memory\n");
+	    ok = sscanf (rest, "%lx %hu %lu %lu %hu %lx %d %n", &id,
+			 &output->info.connection,
+			 &output->info.mm_width, &output->info.mm_height,
+			 &output->info.subpixel_order, &output->info.crtc,
+			 &output->info.npreferred, &m) == 7;
+	    if (ok)
+	    {
+		output->info.timestamp = res->timestamp;
+		output->info.name = strdup (rest + m);
+		output->info.nameLen = strlen (rest + m);
+		output->bpc = 8;
+		res->outputs = realloc (res->outputs, (res->noutput + 1) * sizeof (RROutput));
+		snapshot_outputs = realloc (snapshot_outputs, (res->noutput + 1) * sizeof (snapshot_output_t *));
+		if (!res->outputs || !snapshot_outputs) fatal ("out of memory\n");
+		res->outputs[res->noutput] = id;
+		snapshot_outputs[res->noutput++] = output;
+	    }
+	}
+	else if (!strcmp (key, "output-crtcs") || !strcmp (key, "output-clones") ||
+		 !strcmp (key, "output-modes"))
+	{
+	    ok = sscanf (rest, "%lx%n", &id, &m) == 1;
+	    if (ok)
+	    {
+		XRROutputInfo	*info = &snapshot_output (id)->info;
+
+		switch (key[8]) {
+		case 'r':
+		    ok = (info->ncrtc = read_xids (rest + m, &info->crtcs)) >= 0;
+		    break;
+		case 'l':
+		    ok = (info->nclone = read_xids (rest + m, &info->clones)) >= 0;
+		    break;
+		default:
+		    ok = (info->nmode = read_xids (rest + m, &info->modes)) >= 0 &&
+			 info->npreferred <= info->nmode;
+		    break;
+		}
+	    }
+	}
+	else if (!strcmp (key, "output-tile"))
+	{
+	    tile_t  t;
+
+	    ok = sscanf (rest, "%lx %d %d %d %d %d %d %d %d", &id,
+			 &t.group, &t.flags, &t.num_h, &t.num_v,
+			 &t.h_loc, &t.v_loc, &t.width, &t.height) == 9;
+	    if (ok)
+		snapshot_output (id)->tile = t;
+	}
+	else if (!strcmp (key, "output-bpc"))
+	{
+	    ok = sscanf (rest, "%lx %d", &id, &n) == 2 && n > 0;
+	    if (ok)
+		snapshot_output (id)->bpc = n;
+	}
+	else if (!strcmp (key, "output-path"))
+	{
+	    ok = sscanf (rest, "%lx %n", &id, &m) == 1;
+	    if (ok)
+		snapshot_output (id)->path = strdup (rest + m);
+	}
+	else if (!strcmp (key, "primary"))
+	    ok = sscanf (rest, "%lx", &snapshot_primary) == 1;
+	else
+	    ok = False;
+	if (!ok)
+	    fatal ("%s:%d: invalid snapshot line\n", file, lineno);
+    }
+    fclose (f);
+    if (!res->ncrtc || !res->noutput || !screen_width || !maxWidth)
+	fatal ("%s: incomplete snapshot\n", file);
+}
+
+/*
+ * Server queries used while planning, answered from the snapshot
+ * when simulating
+ */
+static XRRCrtcInfo *
+get_crtc_info (RRCrtc crtc)
+{
+    if (simulate_file)
+	return &snapshot_crtc (crtc)->info;
+    return XRRGetCrtcInfo (dpy, res, crtc);
+}
+
+static XRROutputInfo *
+get_output_info (RROutput output)
+{
+    if (simulate_file)
+	return &snapshot_output (output)->info;
+    return XRRGetOutputInfo (dpy, res, output);
+}
+
+static XRRPanning *
+get_panning (RRCrtc crtc)
+{
+    XRRPanning	*panning;
+
+    if (!simulate_file)
+	return XRRGetPanning (dpy, res, crtc);
+    panning = malloc (sizeof (XRRPanning));
+    if (!panning) fatal ("out of memory\n");
+    *panning = snapshot_crtc (crtc)->panning;
+    return panning;
+}
+
+static void
+get_crtc_transform (RRCrtc crtc, transform_t *transform)
+{
+    XRRCrtcTransformAttributes  *attr;
+
+    if (simulate_file)
+	copy_transform (transform, &snapshot_crtc (crtc)->transform);
+    else if (XRRGetCrtcTransform (dpy, crtc, &attr) && attr) {
+	set_transform (transform,
+		       &attr->currentTransform,
+		       attr->currentFilter,
+		       attr->currentParams,
+		       attr->currentNparams);
+	XFree (attr);
+    }
+    else
+	init_transform (transform);
+}
+
+static int
+get_crtc_gamma_size (RRCrtc crtc)
+{
+    if (simulate_file)
+	return snapshot_crtc (crtc)->gamma_size;
+    return XRRGetCrtcGammaSize (dpy, crtc);
+}
+
+static int
+crtc_gamma_size (crtc_t *crtc)
+{
+    if (!crtc->gamma_size)
+	crtc->gamma_size = get_crtc_gamma_size (crtc->crtc.xid);
+    return crtc->gamma_size;
+}
+
+static XRRCrtcGamma *
+get_crtc_gamma (RRCrtc crtc)
+{
+    XRRCrtcGamma    *gamma;
+    int		    size, shift, i;
+
+    if (!simulate_file)
+	return XRRGetCrtcGamma (dpy, crtc);
+    size = get_crtc_gamma_size (crtc);
+    gamma = XRRAllocGamma (size);
+    if (!gamma)
+	return NULL;
+    shift = 16 - (ffs (size) - 1);
+    for (i = 0; i < size; i++)
+	gamma->red[i] = gamma->green[i] = gamma->blue[i] = i << shift;
+    return gamma;
+}
+
+static RROutput
+get_output_primary (void)
+{
+    if (simulate_file)
+	return snapshot_primary;
+    return XRRGetOutputPrimary (dpy, root);
+}
+
 static Bool
 output_is_primary(output_t *output)
 {
     if (has_1_3)
-	    return XRRGetOutputPrimary(dpy, root) == output->output.xid;
+	    return get_output_primary () == output->output.xid;
     return False;
 }
 
@@ -995,13 +1750,13 @@ set_gamma_info(output_t *output)
     if (!output->crtc_info)
 	return;
 
-    size = XRRGetCrtcGammaSize(dpy, output->crtc_info->crtc.xid);
+    size = crtc_gamma_size (output->crtc_info);
     if (!size) {
 	warning("Failed to get size of gamma for output %s\n", output->output.string);
 	return;
     }
 
-    gamma = XRRGetCrtcGamma(dpy, output->crtc_info->crtc.xid);
+    gamma = get_crtc_gamma (output->crtc_info->crtc.xid);
     if (!gamma) {
 	warning("Failed to get gamma for output %s\n", output->output.string);
 	return;
@@ -1063,6 +1818,81 @@ set_gamma_info(output_t *output)
     XRRFreeGamma(gamma);
 }
 
+/*
+ * Estimate the exponent of one channel with a least squares fit of
+ * log v = g log x + c over the upper three quarters of the curve,
+ * up to where it is clamped. The factor the whole channel was scaled
+ * by only moves c, so a previous --color-temp or --brightness drops
+ * out of g; that factor, e^c relative to full range, goes in *scale
+ */
+static double
+channel_gamma(CARD16 array[], int size, double *scale)
+{
+    double sx = 0, sy = 0, sxx = 0, sxy = 0, x, y, g;
+    int last, i, n = 0;
+
+    /* where the channel reaches its top, clamped or not */
+    for (last = size - 1; last > 0; last--)
+	if (array[last - 1] != array[size - 1])
+	    break;
+    for (i = last / 4; i <= last; i++)
+    {
+	if (i == 0 || array[i] == 0)
+	    continue;
+	x = log((double) i / (size - 1));
+	y = log((double) array[i]);
+	sx += x;
+	sy += y;
+	sxx += x * x;
+	sxy += x * y;
+	n++;
+    }
+    *scale = 1.0;
+    if (n < 2 || n * sxx == sx * sx)
+	return 1.0;
+    g = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+    if (g <= 0.0)
+	return 1.0;
+    *scale = exp((sy - g * sx) / n) /
+	     (double) ((size - 1) << (16 - (ffs(size) - 1)));
+    return g;
+}
+
+/*
+ * Keep the per-channel gamma on the crtc of an output, in the form
+ * --gamma takes, for a --color-temp given without --gamma, and its
+ * brightness unless one was given. Each channel is taken to be a
+ * power curve, so a ramp of another shape, such as a calibration, is
+ * replaced by the nearest one. Values are rounded to three decimals,
+ * so that the estimate doesn't wander by a little each time a tint is
+ * set again
+ */
+static void
+keep_crtc_gamma(output_t *output)
+{
+    XRRCrtcGamma *gamma;
+    double scale[3], brightness;
+    int size, c;
+
+    output->gamma.red = output->gamma.green = output->gamma.blue = 1.0;
+    size = crtc_gamma_size(output->crtc_info);
+    if (!size || !(gamma = get_crtc_gamma(output->crtc_info->crtc.xid)))
+	return;
+    output->gamma.red = floor(1000.0 / channel_gamma(gamma->red, size, &scale[0]) + 0.5) / 1000.0;
+    output->gamma.green = floor(1000.0 / channel_gamma(gamma->green, size, &scale[1]) + 0.5) / 1000.0;
+    output->gamma.blue = floor(1000.0 / channel_gamma(gamma->blue, size, &scale[2]) + 0.5) / 1000.0;
+    XRRFreeGamma(gamma);
+
+    /* a tint leaves its strongest channel at the full brightness */
+    if (!output->brightness_set) {
+	brightness = scale[0];
+	for (c = 1; c < 3; c++)
+	    if (scale[c] > brightness)
+		brightness = scale[c];
+	output->brightness = floor(1000.0 * brightness + 0.5) / 1000.0;
+    }
+}
+
 static void
 set_output_info (output_t *output, RROutput xid, XRROutputInfo *output_info)
 {
@@ -1121,6 +1951,9 @@ set_output_info (output_t *output, RROutput xid, XRROutputInfo *output_info)
 	}
 	else
 	    output->mode_info = NULL;
+	/* --rate max without --mode keeps the current size */
+	if (output->max_refresh && output->mode_info)
+	    output->mode_info = max_refresh_mode (output, output->mode_info);
     }
     else if (output->mode.kind == name_xid && output->mode.xid == None)
 	output->mode_info = NULL;
@@ -1202,9 +2035,6 @@ set_output_info (output_t *output, RROutput xid, XRROutputInfo *output_info)
 				output->mode_info->width;
 	    double sy = (double)output->scale_from_h /
 				output->mode_info->height;
-	    if (verbose)
-		printf("scaling %s by %lfx%lf\n", output->output.string, sx,
-		       sy);
 	    init_transform (&output->transform);
 	    output->transform.transform.matrix[0][0] = XDoubleToFixed (sx);
 	    output->transform.transform.matrix[1][1] = XDoubleToFixed (sy);
@@ -1215,7 +2045,32 @@ set_output_info (output_t *output, RROutput xid, XRROutputInfo *output_info)
 		output->transform.filter = "nearest";
 	    output->transform.nparams = 0;
 	    output->transform.params = NULL;
+	    output->transform.filter =
+		transform_filter (&output->transform.transform,
+				  output->transform.filter);
+	    if (verbose)
+		printf("scaling %s by %lfx%lf, filter %s\n",
+		       output->output.string, sx, sy, output->transform.filter);
+	}
+	else if (output->keystone && output->mode_info) {
+	    init_transform (&output->transform);
+	    if (!keystone_transform (output->keystone_x, output->keystone_y,
+				     mode_width (output->mode_info, output->rotation),
+				     mode_height (output->mode_info, output->rotation),
+				     &output->transform.transform))
+		fatal ("keystone corners of output %s have no solution\n",
+		       output->output.string);
+	    output->transform.filter =
+		transform_filter (&output->transform.transform, "bilinear");
+	    if (verbose)
+		printf("keystone %s, filter %s\n", output->output.string,
+		       output->transform.filter);
 	}
+	/* --transform none keeps no filter at all */
+	else if (*output->transform.filter)
+	    output->transform.filter =
+		transform_filter (&output->transform.transform,
+				  output->transform.filter);
     }
 
     /* set primary */
@@ -1229,6 +2084,14 @@ get_screen (Bool current)
     if (!has_1_2)
         fatal ("Server RandR version before 1.2\n");
     
+    /* read_snapshot() has filled in everything */
+    if (simulate_file)
+	return;
+
+    screen_width = DisplayWidth (dpy, screen);
+    screen_height = DisplayHeight (dpy, screen);
+    screen_width_mm = DisplayWidthMM (dpy, screen);
+    screen_height_mm = DisplayHeightMM (dpy, screen);
     XRRGetScreenSizeRange (dpy, root, &minWidth, &minHeight,
 			   &maxWidth, &maxHeight);
     
@@ -1250,14 +2113,13 @@ get_crtcs (void)
     
     for (c = 0; c < res->ncrtc; c++)
     {
-	XRRCrtcInfo *crtc_info = XRRGetCrtcInfo (dpy, res, res->crtcs[c]);
-	XRRCrtcTransformAttributes  *attr;
+	XRRCrtcInfo *crtc_info = get_crtc_info (res->crtcs[c]);
 	XRRPanning  *panning_info = NULL;
 
 	if (has_1_3) {
 	    XRRPanning zero;
 	    memset(&zero, 0, sizeof(zero));
-	    panning_info = XRRGetPanning  (dpy, res, res->crtcs[c]);
+	    panning_info = get_panning (res->crtcs[c]);
 	    zero.timestamp = panning_info->timestamp;
 	    if (!memcmp(panning_info, &zero, sizeof(zero))) {
 		Xfree(panning_info);
@@ -1270,25 +2132,20 @@ get_crtcs (void)
 	if (!crtc_info) fatal ("could not get crtc 0x%x information\n", res->crtcs[c]);
 	crtcs[c].crtc_info = crtc_info;
 	crtcs[c].panning_info = panning_info;
-	if (crtc_info->mode == None)
+	if (panning_info)
+	{
+	    crtcs[c].current_panning = malloc (sizeof (XRRPanning));
+	    if (!crtcs[c].current_panning) fatal ("out of memory\n");
+	    *crtcs[c].current_panning = *panning_info;
+	}
+	if (crtc_info->mode == None)
 	{
 	    crtcs[c].mode_info = NULL;
 	    crtcs[c].x = 0;
 	    crtcs[c].y = 0;
 	    crtcs[c].rotation = RR_Rotate_0;
 	}
-	if (XRRGetCrtcTransform (dpy, res->crtcs[c], &attr) && attr) {
-	    set_transform (&crtcs[c].current_transform,
-			   &attr->currentTransform,
-			   attr->currentFilter,
-			   attr->currentParams,
-			   attr->currentNparams);
-	    XFree (attr);
-	}
-	else
-	{
-	    init_transform (&crtcs[c].current_transform);
-	}
+	get_crtc_transform (res->crtcs[c], &crtcs[c].current_transform);
 	copy_transform (&crtcs[c].pending_transform, &crtcs[c].current_transform);
    }
 }
@@ -1336,66 +2193,411 @@ set_panning (void)
 	    continue;
 	if (! output->crtc_info->panning_info)
 	    output->crtc_info->panning_info = malloc (sizeof(XRRPanning));
+	else if (!memcmp (&output->crtc_info->panning_info->left,
+			  &output->panning.left,
+			  sizeof (XRRPanning) - offsetof (XRRPanning, left)))
+	    continue;
 	memcpy (output->crtc_info->panning_info, &output->panning, sizeof(XRRPanning));
 	output->crtc_info->changing = 1;
     }
 }
 
+/*
+ * Every change sent to the server is recorded in the journal, so that
+ * a failure can be rolled back by undoing exactly those changes in
+ * reverse order
+ */
+typedef enum _journal_kind {
+    journal_kind_crtc, journal_kind_screen, journal_kind_gamma
+} journal_kind_t;
+
+typedef struct _journal_entry {
+    journal_kind_t  kind;
+    crtc_t	    *crtc;
+    Bool	    panning;		/* crtc: panning was set too */
+    int		    width, height;	/* screen: size which was set */
+    int		    width_mm, height_mm;
+    XRRCrtcGamma    *gamma;		/* gamma: ramp before the change */
+    int		    request;		/* index in the batch, -1 if none */
+    Bool	    skip;		/* nothing to undo */
+} journal_entry_t;
+
+static journal_entry_t	*journal;
+static int		njournal, journal_size;
+
+static journal_entry_t *
+journal_add (journal_kind_t kind, crtc_t *crtc)
+{
+    journal_entry_t *entry;
+
+    if (njournal == journal_size)
+    {
+	journal_size = journal_size ? journal_size * 2 : 16;
+	journal = realloc (journal, journal_size * sizeof (journal_entry_t));
+	if (!journal) fatal ("out of memory\n");
+    }
+    entry = &journal[njournal++];
+    memset (entry, '\0', sizeof (journal_entry_t));
+    entry->kind = kind;
+    entry->crtc = crtc;
+    entry->request = -1;
+    return entry;
+}
+
+static journal_entry_t *
+journal_screen (int width, int height, int width_mm, int height_mm)
+{
+    journal_entry_t *entry = journal_add (journal_kind_screen, NULL);
+
+    entry->width = width;
+    entry->height = height;
+    entry->width_mm = width_mm;
+    entry->height_mm = height_mm;
+    return entry;
+}
+
 static void
-set_gamma(void)
+journal_gamma (crtc_t *crtc, XRRCrtcGamma *gamma)
 {
-    output_t	*output;
+    journal_add (journal_kind_gamma, crtc)->gamma = gamma;
+}
 
-    for (output = outputs; output; output = output->next) {
-	int i, size, shift;
-	crtc_t *crtc;
-	XRRCrtcGamma *gamma;
-	float gammaRed;
-	float gammaGreen;
-	float gammaBlue;
+static void save_last_good (void);
 
-	if (!(output->changes & changes_gamma))
-	    continue;
+/*
+ * Linear red, green and blue of a black body at kelvin degrees with
+ * a luminance of 1: the cubic spline of Kim et al. for the Planckian
+ * locus gives the CIE xy chromaticity, which goes through XYZ to
+ * linear sRGB
+ */
+static void
+blackbody_rgb (double kelvin, double rgb[3])
+{
+    double t = 1000.0 / kelvin;
+    double x, y, X, Z;
 
-	if (!output->crtc_info) {
-	    fatal("Need crtc to set gamma on.\n");
-	    continue;
-	}
+    if (kelvin <= 4000)
+	x = ((-0.2661239 * t - 0.2343589) * t + 0.8776956) * t + 0.179910;
+    else
+	x = ((-3.0258469 * t + 2.1070379) * t + 0.2226347) * t + 0.240390;
+    if (kelvin <= 2222)
+	y = ((-1.1063814 * x - 1.34811020) * x + 2.18555832) * x - 0.20219683;
+    else if (kelvin <= 4000)
+	y = ((-0.9549476 * x - 1.37418593) * x + 2.09137015) * x - 0.16748867;
+    else
+	y = ((3.0817580 * x - 5.87338670) * x + 3.75112997) * x - 0.37001483;
+
+    X = x / y;
+    Z = (1 - x - y) / y;
+    rgb[0] =  3.2404542 * X - 1.5371385 - 0.4985314 * Z;
+    rgb[1] = -0.9692660 * X + 1.8760108 + 0.0415560 * Z;
+    rgb[2] =  0.0556434 * X - 0.2040259 + 1.0572252 * Z;
+}
+
+/*
+ * Channel factors for --color-temp: the black body color relative
+ * to the one at 6500K, which is left white, scaled so the strongest
+ * channel stays at full range
+ */
+static void
+color_temp_scale (double kelvin, double scale[3])
+{
+    double  white[3], max = 0;
+    int	    c;
+
+    blackbody_rgb (6500, white);
+    blackbody_rgb (kelvin, scale);
+    for (c = 0; c < 3; c++)
+    {
+	scale[c] /= white[c];
+	if (scale[c] < 0)
+	    scale[c] = 0;
+	if (scale[c] > max)
+	    max = scale[c];
+    }
+    for (c = 0; c < 3; c++)
+	scale[c] /= max;
+}
+
+/*
+ * Ramps are computed once for each size, gamma, brightness and
+ * color temperature, so outputs sharing a setting share one ramp
+ */
+typedef struct _gamma_memo {
+    struct _gamma_memo	*next;
+    int			size;
+    float		red, green, blue, brightness, color_temp;
+    XRRCrtcGamma	*gamma;
+} gamma_memo_t;
+
+static gamma_memo_t	*gamma_memos;
+
+static XRRCrtcGamma *
+gamma_memo (int size, float red, float green, float blue, float brightness,
+	    float color_temp)
+{
+    gamma_memo_t    *memo;
+    XRRCrtcGamma    *gamma;
+    double	    gammaRed, gammaGreen, gammaBlue;
+    double	    scale[3] = { 1.0, 1.0, 1.0 };
+    double	    brightRed, brightGreen, brightBlue;
+    int		    shift;
+
+    for (memo = gamma_memos; memo; memo = memo->next)
+	if (memo->size == size && memo->red == red && memo->green == green &&
+	    memo->blue == blue && memo->brightness == brightness &&
+	    memo->color_temp == color_temp)
+	    return memo->gamma;
+
+    /*
+     * The hardware color lookup table has a number of significant
+     * bits equal to ffs(size) - 1; compute all values so that
+     * they are in the range [0,size) then shift the values so
+     * that they occupy the MSBs of the 16-bit X Color.
+     */
+    shift = 16 - (ffs(size) - 1);
+
+    gamma = XRRAllocGamma(size);
+    if (!gamma)
+	fatal("Gamma allocation failed.\n");
+
+    gammaRed = 1.0 / red;
+    gammaGreen = 1.0 / green;
+    gammaBlue = 1.0 / blue;
+
+    /* the white point scales the output of the gamma curve */
+    if (color_temp)
+	color_temp_scale(color_temp, scale);
+    brightRed = brightness * scale[0];
+    brightGreen = brightness * scale[1];
+    brightBlue = brightness * scale[2];
+
+    /* channels with the same curve share one ramp */
+    gamma_ramp(gamma->red, size, shift, gammaRed, brightRed);
+    if (gammaGreen == gammaRed && brightGreen == brightRed)
+	memcpy(gamma->green, gamma->red, size * sizeof(unsigned short));
+    else
+	gamma_ramp(gamma->green, size, shift, gammaGreen, brightGreen);
+    if (gammaBlue == gammaRed && brightBlue == brightRed)
+	memcpy(gamma->blue, gamma->red, size * sizeof(unsigned short));
+    else if (gammaBlue == gammaGreen && brightBlue == brightGreen)
+	memcpy(gamma->blue, gamma->green, size * sizeof(unsigned short));
+    else
+	gamma_ramp(gamma->blue, size, shift, gammaBlue, brightBlue);
+
+    memo = malloc (sizeof (gamma_memo_t));
+    if (!memo) fatal ("out of memory\n");
+    memo->size = size;
+    memo->red = red;
+    memo->green = green;
+    memo->blue = blue;
+    memo->brightness = brightness;
+    memo->color_temp = color_temp;
+    memo->gamma = gamma;
+    memo->next = gamma_memos;
+    gamma_memos = memo;
+    return gamma;
+}
+
+static Bool
+equal_gamma (XRRCrtcGamma *a, XRRCrtcGamma *b)
+{
+    return a->size == b->size &&
+	!memcmp(a->red, b->red, a->size * sizeof(unsigned short)) &&
+	!memcmp(a->green, b->green, a->size * sizeof(unsigned short)) &&
+	!memcmp(a->blue, b->blue, a->size * sizeof(unsigned short));
+}
+
+static double
+elapsed_ms (const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000.0 +
+	   (now.tv_nsec - since->tv_nsec) / 1000000.0;
+}
+
+static void
+fade_channel (unsigned short *ramp, const unsigned short *from,
+	      const unsigned short *to, int size, double t)
+{
+    int i;
 
-	crtc = output->crtc_info;
+    for (i = 0; i < size; i++)
+	ramp[i] = from[i] + (to[i] - from[i]) * t;
+}
 
-	size = XRRGetCrtcGammaSize(dpy, crtc->crtc.xid);
+/*
+ * --fade: move every crtc from the ramp it had to the one set_gamma
+ * picked, all of them in the same step, on a fixed schedule of
+ * fade_rate steps a second. Steps blend the two ramps, so no curve
+ * is evaluated once the targets are known; a step that is late is
+ * dropped rather than sent in a burst. This runs once apply() has
+ * made the rest of the change, so the fade neither holds it back
+ * nor is lost when it fails
+ */
+static void
+gamma_fade (void)
+{
+    XRRCrtcGamma    **ramps;
+    struct timespec start, delay;
+    double	    elapsed, t, wait;
+    int		    c, steps = 0;
 
-	if (!size) {
-	    fatal("Gamma size is 0.\n");
+    if (!fade_duration || dryrun)
+	return;
+    for (c = 0; c < num_crtcs; c++)
+	if (crtcs[c].fade_from)
+	    break;
+    if (c == num_crtcs)
+	return;
+    ramps = calloc (num_crtcs, sizeof (XRRCrtcGamma *));
+    if (!ramps) fatal ("out of memory\n");
+    for (c = 0; c < num_crtcs; c++)
+    {
+	if (!crtcs[c].fade_from)
 	    continue;
+	ramps[c] = XRRAllocGamma (crtcs[c].gamma->size);
+	if (!ramps[c])
+	    fatal ("Gamma allocation failed.\n");
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (;;)
+    {
+	elapsed = elapsed_ms (&start);
+	t = elapsed >= fade_duration ? 1.0 : elapsed / fade_duration;
+	for (c = 0; c < num_crtcs; c++)
+	{
+	    crtc_t	    *crtc = &crtcs[c];
+	    XRRCrtcGamma    *from = crtc->fade_from, *to = crtc->gamma;
+	    int		    size = to->size;
+
+	    if (!from)
+		continue;
+	    if (t == 1.0)
+	    {
+		XRRSetCrtcGamma (dpy, crtc->crtc.xid, to);
+		continue;
+	    }
+	    fade_channel (ramps[c]->red, from->red, to->red, size, t);
+	    fade_channel (ramps[c]->green, from->green, to->green, size, t);
+	    fade_channel (ramps[c]->blue, from->blue, to->blue, size, t);
+	    XRRSetCrtcGamma (dpy, crtc->crtc.xid, ramps[c]);
 	}
+	/* don't let steps queue up in the server */
+	XSync (dpy, False);
+	steps++;
+	if (t == 1.0)
+	    break;
 
-	/*
-	 * The gamma-correction lookup table managed through XRR[GS]etCrtcGamma
-	 * is 2^n in size, where 'n' is the number of significant bits in
-	 * the X Color.  Because an X Color is 16 bits, size cannot be larger
-	 * than 2^16.
-	 */
-	if (size > 65536) {
-	    fatal("Gamma correction table is impossibly large.\n");
-	    continue;
+	elapsed = elapsed_ms (&start);
+	wait = (floor (elapsed * fade_rate / 1000) + 1) * 1000 / fade_rate;
+	if (wait > fade_duration)
+	    wait = fade_duration;
+	wait -= elapsed;
+	if (wait > 0)
+	{
+	    delay.tv_sec = wait / 1000;
+	    delay.tv_nsec = (wait - delay.tv_sec * 1000.0) * 1000000;
+	    nanosleep (&delay, NULL);
 	}
+    }
+    if (verbose)
+	printf ("screen %d: faded gamma in %d steps over %.3f ms\n",
+		screen, steps, elapsed_ms (&start));
+    for (c = 0; c < num_crtcs; c++)
+	if (ramps[c])
+	    XRRFreeGamma (ramps[c]);
+    free (ramps);
+}
 
-	/*
-	 * The hardware color lookup table has a number of significant
-	 * bits equal to ffs(size) - 1; compute all values so that
-	 * they are in the range [0,size) then shift the values so
-	 * that they occupy the MSBs of the 16-bit X Color.
-	 */
-	shift = 16 - (ffs(size) - 1);
+/*
+ * The crtc whose gamma the output sets, checked to have a usable ramp
+ */
+static crtc_t *
+gamma_crtc(output_t *output)
+{
+    int size;
 
-	gamma = XRRAllocGamma(size);
-	if (!gamma) {
-	    fatal("Gamma allocation failed.\n");
-	    continue;
+    if (!output->crtc_info)
+	fatal("Need crtc to set gamma on.\n");
+
+    size = crtc_gamma_size(output->crtc_info);
+    if (!size)
+	fatal("Gamma size is 0.\n");
+
+    /*
+     * The gamma-correction lookup table managed through XRR[GS]etCrtcGamma
+     * is 2^n in size, where 'n' is the number of significant bits in
+     * the X Color.  Because an X Color is 16 bits, size cannot be larger
+     * than 2^16.
+     */
+    if (size > 65536)
+	fatal("Gamma correction table is impossibly large.\n");
+    return output->crtc_info;
+}
+
+/*
+ * Put 'gamma' on the crtc unless it is already there; returns whether
+ * it differed from the ramp in use
+ */
+static Bool
+change_crtc_gamma(crtc_t *crtc, XRRCrtcGamma *gamma)
+{
+    XRRCrtcGamma *current = NULL;
+
+    /* a clone on the same crtc may have set it already */
+    if (crtc->gamma == gamma)
+	return False;
+    if (!crtc->gamma) {
+	current = get_crtc_gamma(crtc->crtc.xid);
+	if (current && equal_gamma(current, gamma)) {
+	    XRRFreeGamma(current);
+	    crtc->gamma = gamma;
+	    return False;
 	}
+    }
+
+    if (!dryrun) {
+	save_last_good();
+	if (current)
+	    journal_gamma(crtc, current);
+	/* gamma_fade() sends these once apply() is done */
+	if (fade_duration && current && current->size == gamma->size)
+	    crtc->fade_from = current;
+    }
+    /* like the primary output, gamma is set even by --dryrun */
+    if (!simulate_file && !crtc->fade_from)
+	XRRSetCrtcGamma(dpy, crtc->crtc.xid, gamma);
+    crtc->gamma = gamma;
+    return True;
+}
+
+/*
+ * Returns whether any ramp differed from the one already in use
+ */
+static Bool
+set_gamma(void)
+{
+    output_t	*output;
+    Bool	changed = False;
+    int		c;
+
+    for (output = outputs; output; output = output->next) {
+	crtc_t *crtc;
+	XRRCrtcGamma *gamma;
+
+	if (!(output->changes & changes_gamma))
+	    continue;
 
+	/* checked again, since replayed plans don't go through preflight() */
+	crtc = gamma_crtc(output);
+
+	if (output->color_temp && output->gamma.red == 0.0 &&
+	    output->gamma.green == 0.0 && output->gamma.blue == 0.0)
+	    keep_crtc_gamma(output);
 	if (output->gamma.red == 0.0)
 	    output->gamma.red = 1.0;
 	if (output->gamma.green == 0.0)
@@ -1403,40 +2605,112 @@ set_gamma(void)
 	if (output->gamma.blue == 0.0)
 	    output->gamma.blue = 1.0;
 
-	gammaRed = 1.0 / output->gamma.red;
-	gammaGreen = 1.0 / output->gamma.green;
-	gammaBlue = 1.0 / output->gamma.blue;
+	gamma = gamma_memo(crtc_gamma_size(crtc), output->gamma.red,
+			   output->gamma.green, output->gamma.blue,
+			   output->brightness, output->color_temp);
+	if (change_crtc_gamma(crtc, gamma))
+	    changed = True;
+    }
 
-	for (i = 0; i < size; i++) {
-	    if (gammaRed == 1.0 && output->brightness == 1.0)
-		gamma->red[i] = i;
-	    else
-		gamma->red[i] = dmin(pow((double)i/(double)(size - 1),
-					 gammaRed) * output->brightness,
-				     1.0) * (double)(size - 1);
-	    gamma->red[i] <<= shift;
+    /* ramps of a saved plan are put back exactly */
+    for (c = 0; c < num_crtcs; c++) {
+	crtc_t *crtc = &crtcs[c];
 
-	    if (gammaGreen == 1.0 && output->brightness == 1.0)
-		gamma->green[i] = i;
-	    else
-		gamma->green[i] = dmin(pow((double)i/(double)(size - 1),
-					   gammaGreen) * output->brightness,
-				       1.0) * (double)(size - 1);
-	    gamma->green[i] <<= shift;
+	if (!crtc->plan_gamma)
+	    continue;
+	if (crtc->plan_gamma->size != crtc_gamma_size(crtc)) {
+	    warning("saved gamma of crtc %d no longer fits, not restored\n",
+		    crtc->crtc.index);
+	    continue;
+	}
+	if (change_crtc_gamma(crtc, crtc->plan_gamma))
+	    changed = True;
+    }
+    return changed;
+}
 
-	    if (gammaBlue == 1.0 && output->brightness == 1.0)
-		gamma->blue[i] = i;
-	    else
-		gamma->blue[i] = dmin(pow((double)i/(double)(size - 1),
-					  gammaBlue) * output->brightness,
-				      1.0) * (double)(size - 1);
-	    gamma->blue[i] <<= shift;
+/*
+ * Check the complete planned configuration before the first request
+ * is sent, so that anything the server would reject is caught here
+ * instead of in the middle of apply(), where the only way out is to
+ * revert every crtc
+ */
+static void
+preflight (void)
+{
+    output_t	*output;
+    int		c, o, l;
+
+    for (c = 0; c < num_crtcs; c++)
+    {
+	crtc_t	*crtc = &crtcs[c];
+	box_t	bounds;
+	int	x, y, w, h;
+
+	if (!crtc->mode_info)
+	    continue;
+
+	if (!crtc_can_use_rotation (crtc, crtc->rotation))
+	    fatal ("crtc %d cannot use rotation \"%s\" reflection \"%s\"\n",
+		   crtc->crtc.index,
+		   rotation_name (crtc->rotation),
+		   reflection_name (crtc->rotation));
+
+	if (!has_1_3 && !transform_is_identity (&crtc->pending_transform.transform))
+	    fatal ("transforms need RandR 1.3\n");
+
+	for (o = 0; o < crtc->noutput; o++)
+	{
+	    output = crtc->outputs[o];
+	    if (!output_can_use_crtc (output, crtc))
+		fatal ("output %s cannot use crtc %d\n", output->output.string,
+		       crtc->crtc.index);
+	    if (!output_can_use_mode (output, crtc->mode_info))
+		fatal ("output %s cannot use mode %s\n", output->output.string,
+		       crtc->mode_info->name);
+	    /* every output on the crtc must be able to clone the others */
+	    for (l = 0; l < crtc->noutput; l++)
+	    {
+		int k;
+
+		if (l == o)
+		    continue;
+		for (k = 0; k < output->output_info->nclone; k++)
+		    if (output->output_info->clones[k] == crtc->outputs[l]->output.xid)
+			break;
+		if (k == output->output_info->nclone)
+		    fatal ("output %s cannot be a clone of %s\n",
+			   output->output.string, crtc->outputs[l]->output.string);
+	    }
 	}
 
-	XRRSetCrtcGamma(dpy, crtc->crtc.xid, gamma);
+	mode_geometry (crtc->mode_info, crtc->rotation,
+		       &crtc->pending_transform.transform, &bounds);
+	x = crtc->x + (bounds.x1 > 0 ? bounds.x1 : 0);
+	y = crtc->y + (bounds.y1 > 0 ? bounds.y1 : 0);
+	w = bounds.x2 - bounds.x1;
+	h = bounds.y2 - bounds.y1;
+	if (x + w > fb_width || y + h > fb_height)
+	    fatal ("crtc %d (%dx%d+%d+%d) does not fit in the %dx%d screen\n",
+		   crtc->crtc.index, w, h, x, y, fb_width, fb_height);
+
+	if (crtc->panning_info && crtc->changing)
+	{
+	    XRRPanning	*pan = crtc->panning_info;
 
-	free(gamma);
+	    if (!has_1_3)
+		fatal ("panning needs RandR 1.3\n");
+	    if ((int) (pan->left + pan->width) > fb_width ||
+		(int) (pan->top + pan->height) > fb_height)
+		fatal ("panning area %dx%d+%d+%d does not fit in the %dx%d screen\n",
+		       pan->width, pan->height, pan->left, pan->top,
+		       fb_width, fb_height);
+	}
     }
+
+    for (output = outputs; output; output = output->next)
+	if (output->changes & changes_gamma)
+	    (void) gamma_crtc (output);
 }
 
 static void
@@ -1444,6 +2718,8 @@ set_primary(void)
 {
     output_t *output;
 
+    if (simulate_file)
+	return;
     if (no_primary) {
 	XRRSetOutputPrimary(dpy, root, None);
     } else {
@@ -1456,144 +2732,435 @@ set_primary(void)
     }
 }
 
-static Status
-crtc_disable (crtc_t *crtc)
+/*
+ * Configuration changes are sent as one batch: each request is queued
+ * without waiting for its reply, and the replies and errors are
+ * collected by sequence number when the batch is flushed, so the whole
+ * change costs a single round trip
+ */
+typedef struct _batch_request {
+    unsigned long   sequence;
+    crtc_t	    *crtc;		/* NULL for screen requests */
+    Status	    status;
+    unsigned char   error;		/* X error code, if any */
+} batch_request_t;
+
+static batch_request_t	*batch;
+static int		nbatch, batch_size;
+static Bool		batch_active;
+static int		randr_opcode;
+static _XAsyncHandler	batch_async;
+static XErrorHandler	batch_old_handler;
+static Time		batch_timestamp;
+
+static batch_request_t *
+find_batch_request (unsigned long sequence)
 {
-    if (verbose)
-    	printf ("crtc %d: disable\n", crtc->crtc.index);
-	
-    if (dryrun)
-	return RRSetConfigSuccess;
-    return XRRSetCrtcConfig (dpy, res, crtc->crtc.xid, CurrentTime,
-			     0, 0, None, RR_Rotate_0, NULL, 0);
+    int	b;
+
+    for (b = 0; b < nbatch; b++)
+	if (batch[b].sequence == sequence)
+	    return &batch[b];
+    return NULL;
 }
 
+/*
+ * Record the last request sent as part of the batch
+ */
 static void
-crtc_set_transform (crtc_t *crtc, transform_t *transform)
+batch_queue (crtc_t *crtc)
 {
-    int	major, minor;
-
-    XRRQueryVersion (dpy, &major, &minor);
-    if (major > 1 || (major == 1 && minor >= 3))
-	XRRSetCrtcTransform (dpy, crtc->crtc.xid,
-			     &transform->transform,
-			     transform->filter,
-			     transform->params,
-			     transform->nparams);
+    if (nbatch == batch_size)
+    {
+	batch_size = batch_size ? batch_size * 2 : 16;
+	batch = realloc (batch, batch_size * sizeof (batch_request_t));
+	if (!batch) fatal ("out of memory\n");
+    }
+    batch[nbatch].sequence = NextRequest (dpy) - 1;
+    batch[nbatch].crtc = crtc;
+    batch[nbatch].status = RRSetConfigSuccess;
+    batch[nbatch].error = Success;
+    nbatch++;
 }
 
-static Status
-crtc_revert (crtc_t *crtc)
+/*
+ * SetCrtcConfig and SetPanning replies carry the status in the same place
+ */
+static Bool
+batch_reply (Display *display, xReply *rep, char *buf, int len,
+	     XPointer data _X_UNUSED)
 {
-    XRRCrtcInfo	*crtc_info = crtc->crtc_info;
-    
-    if (verbose)
-    	printf ("crtc %d: revert\n", crtc->crtc.index);
-	
-    if (dryrun)
-	return RRSetConfigSuccess;
+    batch_request_t		*request;
+    xRRSetCrtcConfigReply	reply;
 
-    if (!equal_transform (&crtc->current_transform, &crtc->pending_transform))
-	crtc_set_transform (crtc, &crtc->current_transform);
-    return XRRSetCrtcConfig (dpy, res, crtc->crtc.xid, CurrentTime,
-			    crtc_info->x, crtc_info->y,
-			    crtc_info->mode, crtc_info->rotation,
-			    crtc_info->outputs, crtc_info->noutput);
+    if (rep->generic.type != X_Reply)
+	return False;
+    request = find_batch_request (display->last_request_read);
+    if (!request)
+	return False;
+    _XGetAsyncReply (display, (char *) &reply, rep, buf, len,
+		     (SIZEOF (xRRSetCrtcConfigReply) - SIZEOF (xReply)) >> 2,
+		     False);
+    request->status = reply.status;
+    return True;
 }
 
-static Status
-crtc_apply (crtc_t *crtc)
+static int
+batch_error (Display *display, XErrorEvent *event)
 {
-    RROutput	*rr_outputs;
-    int		o;
-    Status	s;
-    RRMode	mode = None;
-
-    if (!crtc->changing || !crtc->mode_info)
-	return RRSetConfigSuccess;
+    batch_request_t *request = find_batch_request (event->serial);
 
-    rr_outputs = calloc (crtc->noutput, sizeof (RROutput));
-    if (!rr_outputs)
-	return BadAlloc;
-    for (o = 0; o < crtc->noutput; o++)
-	rr_outputs[o] = crtc->outputs[o]->output.xid;
-    mode = crtc->mode_info->id;
-    if (verbose) {
-	printf ("crtc %d: %12s %6.1f +%d+%d", crtc->crtc.index,
-		crtc->mode_info->name, mode_refresh (crtc->mode_info),
-		crtc->x, crtc->y);
-	for (o = 0; o < crtc->noutput; o++)
-	    printf (" \"%s\"", crtc->outputs[o]->output.string);
-	printf ("\n");
-    }
-    
-    if (dryrun)
-	s = RRSetConfigSuccess;
-    else
-    {
-	if (!equal_transform (&crtc->current_transform, &crtc->pending_transform))
-	    crtc_set_transform (crtc, &crtc->pending_transform);
-	s = XRRSetCrtcConfig (dpy, res, crtc->crtc.xid, CurrentTime,
-			      crtc->x, crtc->y, mode, crtc->rotation,
-			      rr_outputs, crtc->noutput);
-	if (s == RRSetConfigSuccess && crtc->panning_info) {
-	    if (has_1_3)
-		s = XRRSetPanning (dpy, res, crtc->crtc.xid, crtc->panning_info);
-	    else
-		fatal ("panning needs RandR 1.3\n");
-	}
-    }
-    free (rr_outputs);
-    return s;
+    if (!request)
+	return batch_old_handler (display, event);
+    request->status = RRSetConfigFailed;
+    request->error = event->error_code;
+    return 0;
 }
 
 static void
-screen_revert (void)
+batch_begin (void)
 {
-    if (verbose)
-	printf ("screen %d: revert\n", screen);
+    int	event_base, error_base;
 
+    nbatch = 0;
+    batch_timestamp = CurrentTime;
     if (dryrun)
 	return;
-    XRRSetScreenSize (dpy, root,
-		      DisplayWidth (dpy, screen),
-		      DisplayHeight (dpy, screen),
-		      DisplayWidthMM (dpy, screen),
-		      DisplayHeightMM (dpy, screen));
+    if (!randr_opcode &&
+	!XQueryExtension (dpy, RANDR_NAME, &randr_opcode,
+			  &event_base, &error_base))
+	fatal ("RandR extension missing\n");
+    LockDisplay (dpy);
+    batch_async.next = dpy->async_handlers;
+    batch_async.handler = batch_reply;
+    batch_async.data = NULL;
+    dpy->async_handlers = &batch_async;
+    UnlockDisplay (dpy);
+    batch_old_handler = XSetErrorHandler (batch_error);
+    batch_active = True;
 }
 
-static void
-screen_apply (void)
+/*
+ * Wait for the whole batch and return the first request which failed
+ */
+static batch_request_t *
+batch_flush (void)
+{
+    int	b;
+
+    if (!batch_active)
+	return NULL;
+    XSync (dpy, False);
+    LockDisplay (dpy);
+    DeqAsyncHandler (dpy, &batch_async);
+    UnlockDisplay (dpy);
+    XSetErrorHandler (batch_old_handler);
+    batch_active = False;
+    for (b = 0; b < nbatch; b++)
+	if (batch[b].status != RRSetConfigSuccess)
+	    return &batch[b];
+    return NULL;
+}
+
+static void
+batch_set_crtc_config (crtc_t *crtc, int x, int y, RRMode mode,
+		       Rotation rotation, RROutput *crtc_outputs, int noutput)
+{
+    xRRSetCrtcConfigReq	*req;
+
+    LockDisplay (dpy);
+    GetReq (RRSetCrtcConfig, req);
+    req->reqType = randr_opcode;
+    req->randrReqType = X_RRSetCrtcConfig;
+    req->length += noutput;
+    req->crtc = crtc->crtc.xid;
+    /*
+     * A successful request leaves the server's last set time at the
+     * timestamp it carried, so every request of an --optimistic
+     * batch can carry the one the plan was made against
+     */
+    req->timestamp = batch_timestamp;
+    req->configTimestamp = res->configTimestamp;
+    req->x = x;
+    req->y = y;
+    req->mode = mode;
+    req->rotation = rotation;
+    Data32 (dpy, crtc_outputs, noutput << 2);
+    UnlockDisplay (dpy);
+    SyncHandle ();
+    batch_queue (crtc);
+}
+
+static void
+batch_set_panning (crtc_t *crtc, XRRPanning *panning)
+{
+    xRRSetPanningReq	*req;
+
+    LockDisplay (dpy);
+    GetReq (RRSetPanning, req);
+    req->reqType = randr_opcode;
+    req->randrReqType = X_RRSetPanning;
+    req->crtc = crtc->crtc.xid;
+    req->timestamp = panning->timestamp;
+    req->left = panning->left;
+    req->top = panning->top;
+    req->width = panning->width;
+    req->height = panning->height;
+    req->track_left = panning->track_left;
+    req->track_top = panning->track_top;
+    req->track_width = panning->track_width;
+    req->track_height = panning->track_height;
+    req->border_left = panning->border_left;
+    req->border_top = panning->border_top;
+    req->border_right = panning->border_right;
+    req->border_bottom = panning->border_bottom;
+    UnlockDisplay (dpy);
+    SyncHandle ();
+    batch_queue (crtc);
+}
+
+static void
+batch_set_screen_size (int width, int height, int width_mm, int height_mm)
+{
+    XRRSetScreenSize (dpy, root, width, height, width_mm, height_mm);
+    batch_queue (NULL);
+}
+
+static void
+crtc_disable (crtc_t *crtc, Bool report)
+{
+    journal_entry_t *entry;
+
+    if (report)
+    {
+	if (verbose)
+	    printf ("crtc %d: disable\n", crtc->crtc.index);
+	return;
+    }
+    if (dryrun)
+	return;
+    entry = journal_add (journal_kind_crtc, crtc);
+    batch_set_crtc_config (crtc, 0, 0, None, RR_Rotate_0, NULL, 0);
+    entry->request = nbatch - 1;
+}
+
+static void
+crtc_set_transform (crtc_t *crtc, transform_t *transform)
+{
+    if (!has_1_3)
+	return;
+    XRRSetCrtcTransform (dpy, crtc->crtc.xid,
+			 &transform->transform,
+			 transform->filter,
+			 transform->params,
+			 transform->nparams);
+    batch_queue (crtc);
+}
+
+static void
+crtc_revert (crtc_t *crtc, Bool panning)
+{
+    XRRCrtcInfo	*crtc_info = crtc->crtc_info;
+    XRRPanning	pan;
+    
+    if (verbose)
+    	printf ("crtc %d: revert\n", crtc->crtc.index);
+	
+    if (dryrun)
+	return;
+
+    if (!equal_transform (&crtc->current_transform, &crtc->pending_transform))
+	crtc_set_transform (crtc, &crtc->current_transform);
+    batch_set_crtc_config (crtc, crtc_info->x, crtc_info->y,
+			   crtc_info->mode, crtc_info->rotation,
+			   crtc_info->outputs, crtc_info->noutput);
+    if (panning)
+    {
+	/* all zeros turns panning off again */
+	if (crtc->current_panning)
+	    pan = *crtc->current_panning;
+	else
+	    memset (&pan, '\0', sizeof (pan));
+	pan.timestamp = CurrentTime;
+	batch_set_panning (crtc, &pan);
+    }
+}
+
+static void
+crtc_revert_gamma (crtc_t *crtc, XRRCrtcGamma *gamma)
+{
+    if (verbose)
+	printf ("crtc %d: revert gamma\n", crtc->crtc.index);
+
+    if (dryrun)
+	return;
+    XRRSetCrtcGamma (dpy, crtc->crtc.xid, gamma);
+    batch_queue (crtc);
+}
+
+static Status
+crtc_apply (crtc_t *crtc, Bool report)
+{
+    RROutput	    *rr_outputs;
+    journal_entry_t *entry;
+    int		    o;
+
+    if (!crtc->changing || !crtc->mode_info)
+	return RRSetConfigSuccess;
+
+    if (report)
+    {
+	if (!verbose)
+	    return RRSetConfigSuccess;
+	printf ("crtc %d: %12s %6.1f +%d+%d", crtc->crtc.index,
+		crtc->mode_info->name, mode_refresh (crtc->mode_info),
+		crtc->x, crtc->y);
+	for (o = 0; o < crtc->noutput; o++)
+	    printf (" \"%s\"", crtc->outputs[o]->output.string);
+	if (!equal_transform (&crtc->current_transform, &crtc->pending_transform))
+	    printf (" filter %s", *crtc->pending_transform.filter ?
+		    crtc->pending_transform.filter : "none");
+	printf ("\n");
+	return RRSetConfigSuccess;
+    }
+    
+    if (dryrun)
+	return RRSetConfigSuccess;
+
+    rr_outputs = calloc (crtc->noutput, sizeof (RROutput));
+    if (!rr_outputs)
+	return BadAlloc;
+    for (o = 0; o < crtc->noutput; o++)
+	rr_outputs[o] = crtc->outputs[o]->output.xid;
+    entry = journal_add (journal_kind_crtc, crtc);
+    entry->panning = crtc->panning_info != NULL;
+    if (!equal_transform (&crtc->current_transform, &crtc->pending_transform))
+	crtc_set_transform (crtc, &crtc->pending_transform);
+    batch_set_crtc_config (crtc, crtc->x, crtc->y, crtc->mode_info->id,
+			   crtc->rotation, rr_outputs, crtc->noutput);
+    entry->request = nbatch - 1;
+    if (crtc->panning_info)
+	batch_set_panning (crtc, crtc->panning_info);
+    free (rr_outputs);
+    return RRSetConfigSuccess;
+}
+
+static void
+screen_revert (int width, int height, int width_mm, int height_mm)
 {
-    if (fb_width == DisplayWidth (dpy, screen) &&
-	fb_height == DisplayHeight (dpy, screen) &&
-	fb_width_mm == DisplayWidthMM (dpy, screen) &&
-	fb_height_mm == DisplayHeightMM (dpy, screen))
-    {
-	return;
-    }
     if (verbose)
-	printf ("screen %d: %dx%d %dx%d mm %6.2fdpi\n", screen,
-		fb_width, fb_height, fb_width_mm, fb_height_mm, dpi);
+	printf ("screen %d: revert to %dx%d\n", screen, width, height);
+
+    if (dryrun)
+	return;
+    batch_set_screen_size (width, height, width_mm, height_mm);
+}
+
+static void
+screen_apply (Bool report)
+{
+    journal_entry_t *entry;
+
+    if (fb_width == screen_width &&
+	fb_height == screen_height &&
+	fb_width_mm == screen_width_mm &&
+	fb_height_mm == screen_height_mm)
+    {
+	return;
+    }
+    if (report)
+    {
+	if (verbose)
+	    printf ("screen %d: %dx%d %dx%d mm %6.2fdpi\n", screen,
+		    fb_width, fb_height, fb_width_mm, fb_height_mm, dpi);
+	return;
+    }
+    if (dryrun)
+	return;
+    entry = journal_screen (fb_width, fb_height, fb_width_mm, fb_height_mm);
+    batch_set_screen_size (fb_width, fb_height, fb_width_mm, fb_height_mm);
+    entry->request = nbatch - 1;
+}
+
+/*
+ * Temporarily set a screen size which holds both the current
+ * and the new configuration, keeping the current dpi
+ */
+static void
+screen_grow (int width, int height, Bool report)
+{
+    int		    width_mm = (screen_width_mm * width) / screen_width;
+    int		    height_mm = (screen_height_mm * height) / screen_height;
+    journal_entry_t *entry;
+
+    if (report)
+    {
+	if (verbose)
+	    printf ("screen %d: %dx%d %dx%d mm (intermediate)\n", screen,
+		    width, height, width_mm, height_mm);
+	return;
+    }
     if (dryrun)
 	return;
-    XRRSetScreenSize (dpy, root, fb_width, fb_height,
-		      fb_width_mm, fb_height_mm);
+    entry = journal_screen (width, height, width_mm, height_mm);
+    batch_set_screen_size (width, height, width_mm, height_mm);
+    entry->request = nbatch - 1;
 }
 
+/*
+ * Undo the journal, newest change first. Each step puts back the state
+ * from just before the matching change, so crtcs and screen sizes are
+ * restored in an order the server accepts, and anything which was not
+ * touched, or which the server refused, is left alone
+ */
 static void
 revert (void)
 {
-    int	c;
+    int		    j, p;
+    journal_entry_t *entry;
 
-    /* first disable all crtcs */
-    for (c = 0; c < res->ncrtc; c++)
-	crtc_disable (&crtcs[c]);
-    /* next reset screen size */
-    screen_revert ();
-    /* now restore all crtcs */
-    for (c = 0; c < res->ncrtc; c++)
-	crtc_revert (&crtcs[c]);
+    /* the last batch is still around until the revert queues its own */
+    for (j = 0; j < njournal; j++)
+    {
+	entry = &journal[j];
+	if (entry->request >= 0 && entry->request < nbatch &&
+	    batch[entry->request].status != RRSetConfigSuccess)
+	    entry->skip = True;
+	entry->request = -1;
+    }
+    batch_begin ();
+    if (grab_server && !simulate_file)
+	XGrabServer (dpy);
+    for (j = njournal - 1; j >= 0; j--)
+    {
+	entry = &journal[j];
+	if (entry->skip)
+	    continue;
+	switch (entry->kind) {
+	case journal_kind_crtc:
+	    crtc_revert (entry->crtc, entry->panning);
+	    break;
+	case journal_kind_screen:
+	    /* go back to the size set before this one */
+	    for (p = j - 1; p >= 0; p--)
+		if (journal[p].kind == journal_kind_screen && !journal[p].skip)
+		    break;
+	    if (p >= 0)
+		screen_revert (journal[p].width, journal[p].height,
+			       journal[p].width_mm, journal[p].height_mm);
+	    else
+		screen_revert (screen_width, screen_height,
+			       screen_width_mm, screen_height_mm);
+	    break;
+	case journal_kind_gamma:
+	    crtc_revert_gamma (entry->crtc, entry->gamma);
+	    break;
+	}
+    }
+    njournal = 0;
+    if (grab_server && !simulate_file)
+	XUngrabServer (dpy);
+    batch_flush ();
 }
 
 /*
@@ -1604,7 +3171,6 @@ revert (void)
 static void _X_NORETURN
 panic (Status s, crtc_t *crtc)
 {
-    int	    c = crtc->crtc.index;
     const char *message;
     
     switch (s) {
@@ -1616,76 +3182,153 @@ panic (Status s, crtc_t *crtc)
     default:				message = "unknown failure";	    break;
     }
     
-    fprintf (stderr, "%s: Configure crtc %d %s\n", program_name, c, message);
+    if (crtc)
+	fprintf (stderr, "%s: Configure crtc %d %s\n", program_name,
+		 crtc->crtc.index, message);
+    else
+	fprintf (stderr, "%s: Configure screen %d %s\n", program_name,
+		 screen, message);
+    /* drop anything still queued before putting things back */
+    batch_flush ();
     revert ();
     exit (1);
 }
 
+/*
+ * In --optimistic mode, another client changing the configuration
+ * between our reading it and applying the batch shows up as a stale
+ * timestamp. Undo whatever did get applied and start over with fresh
+ * state, a bounded number of times
+ */
+#define OPTIMISTIC_RETRIES	3
+
+static int	optimistic_retries;
+
+/*
+ * Drop the journal entries for crtcs and screen sizes which no longer
+ * hold what this batch set: the other client has changed them since,
+ * and putting back our stale state would undo its change instead
+ */
 static void
-apply (void)
+journal_drop_overwritten (void)
+{
+    journal_entry_t *entry;
+    XRRCrtcInfo	    *crtc_info;
+    Window	    root_return;
+    int		    x, y, j;
+    unsigned int    width, height, border, depth;
+    Bool	    screen_ours = True, screen_seen = False;
+
+    for (j = njournal - 1; j >= 0; j--)
+    {
+	entry = &journal[j];
+	if (entry->skip)
+	    continue;
+	switch (entry->kind) {
+	case journal_kind_crtc:
+	    crtc_info = XRRGetCrtcInfo (dpy, res, entry->crtc->crtc.xid);
+	    if (!crtc_info ||
+		(entry->crtc->mode_info ?
+		 (crtc_info->mode != entry->crtc->mode_info->id ||
+		  crtc_info->x != entry->crtc->x ||
+		  crtc_info->y != entry->crtc->y ||
+		  crtc_info->rotation != entry->crtc->rotation) :
+		 crtc_info->mode != None))
+		entry->skip = True;
+	    if (crtc_info)
+		XRRFreeCrtcInfo (crtc_info);
+	    break;
+	case journal_kind_screen:
+	    /* the newest size set decides for all of them */
+	    if (!screen_seen)
+	    {
+		screen_seen = True;
+		screen_ours = XGetGeometry (dpy, root, &root_return, &x, &y,
+					    &width, &height, &border, &depth) &&
+			      (int) width == entry->width &&
+			      (int) height == entry->height;
+	    }
+	    entry->skip = !screen_ours;
+	    break;
+	case journal_kind_gamma:
+	    break;
+	}
+    }
+}
+
+/*
+ * Send the queued requests and bail out if any of them failed. Returns
+ * False when an --optimistic batch lost a race with another client
+ * and was undone, so that the caller can plan it again
+ */
+static Bool
+batch_check (void)
+{
+    batch_request_t *failed = batch_flush ();
+    char	    text[256];
+
+    if (!failed)
+	return True;
+    if (optimistic && optimistic_retries < OPTIMISTIC_RETRIES &&
+	(failed->status == RRSetConfigInvalidTime ||
+	 failed->status == RRSetConfigInvalidConfigTime))
+    {
+	journal_drop_overwritten ();
+	revert ();
+	optimistic_retries++;
+	if (verbose)
+	    printf ("screen %d: configuration changed by another client, "
+		    "retrying (%d of %d)\n", screen, optimistic_retries,
+		    OPTIMISTIC_RETRIES);
+	return False;
+    }
+    if (failed->error != Success)
+    {
+	XGetErrorText (dpy, failed->error, text, sizeof (text));
+	fprintf (stderr, "%s: %s\n", program_name, text);
+    }
+    panic (failed->status, failed->crtc);
+}
+
+/*
+ * Walk the ordered list of changes, either reporting them or
+ * queueing the requests which make them
+ */
+static void
+apply_changes (Bool report)
 {
     Status  s;
     int	    c;
-    
-    /*
-     * Hold the server grabbed while messing with
-     * the screen so that apps which notice the resize
-     * event and ask for xinerama information from the server
-     * receive up-to-date information
-     */
-    if (grab_server)
-	XGrabServer (dpy);
-    
+    int	    width = screen_width;
+    int	    height = screen_height;
+    Bool    resize_first;
+
     /*
-     * Turn off any crtcs which are to be disabled or which are
-     * larger than the target size
+     * Turn off any crtcs which are to be disabled. Crtcs which stay
+     * on are moved directly to their new configuration below, so
+     * those which only change position never go dark
      */
     for (c = 0; c < res->ncrtc; c++)
     {
-	crtc_t	    *crtc = &crtcs[c];
-	XRRCrtcInfo *crtc_info = crtc->crtc_info;
-
-	/* if this crtc is already disabled, skip it */
-	if (crtc_info->mode == None) 
-	    continue;
-	
-	/* 
-	 * If this crtc is to be left enabled, make
-	 * sure the old size fits then new screen
-	 */
-	if (crtc->mode_info) 
-	{
-	    XRRModeInfo	*old_mode = find_mode_by_xid (crtc_info->mode);
-	    int x, y, w, h;
-	    box_t bounds;
+	crtc_t	*crtc = &crtcs[c];
 
-	    if (!old_mode) 
-		panic (RRSetConfigFailed, crtc);
-	    
-	    /* old position and size information */
-	    mode_geometry (old_mode, crtc_info->rotation,
-			   &crtc->current_transform.transform,
-			   &bounds);
-
-	    x = crtc_info->x + bounds.x1;
-	    y = crtc_info->y + bounds.y1;
-	    w = bounds.x2 - bounds.x1;
-	    h = bounds.y2 - bounds.y1;
-
-	    /* if it fits, skip it */
-	    if (x + w <= fb_width && y + h <= fb_height) 
-		continue;
-	    crtc->changing = True;
-	}
-	s = crtc_disable (crtc);
-	if (s != RRSetConfigSuccess)
-	    panic (s, crtc);
+	if (crtc->crtc_info->mode != None && !crtc->mode_info)
+	    crtc_disable (crtc, report);
     }
 
     /*
-     * Set the screen size
+     * Set the screen size. When the screen grows, do it before
+     * touching the crtcs; when it shrinks, after they have all been
+     * moved inside the new size. When it grows in one direction and
+     * shrinks in the other, go through a size large enough for both
+     * the old and the new configuration
      */
-    screen_apply ();
+    resize_first = fb_width >= width && fb_height >= height;
+    if (resize_first)
+	screen_apply (report);
+    else if (fb_width > width || fb_height > height)
+	screen_grow (fb_width > width ? fb_width : width,
+		     fb_height > height ? fb_height : height, report);
     
     /*
      * Set crtcs
@@ -1695,666 +3338,3040 @@ apply (void)
     {
 	crtc_t	*crtc = &crtcs[c];
 	
-	s = crtc_apply (crtc);
+	s = crtc_apply (crtc, report);
 	if (s != RRSetConfigSuccess)
 	    panic (s, crtc);
     }
 
-    set_primary ();
-
-    /*
-     * Release the server grab and let all clients
-     * respond to the updated state
-     */
-    if (grab_server)
-	XUngrabServer (dpy);
+    if (!resize_first)
+	screen_apply (report);
 }
 
 /*
- * Use current output state to complete the output list
+ * Drop a primary output change which is already in effect, and
+ * stop here when nothing else differs from the current state
+ * either, without touching the server
  */
 static void
-get_outputs (void)
+exit_if_unchanged (Bool gamma_changed)
 {
-    int		o;
-    output_t    *q;
+    output_t	*output;
+    RROutput	primary = None;
+    Bool	changed = gamma_changed;
+    int		c;
+
+    if (has_1_3)
+	primary = get_output_primary ();
+    if (no_primary)
+    {
+	if (primary == None)
+	    no_primary = False;
+	else
+	    changed = True;
+    }
+    for (output = outputs; output; output = output->next)
+    {
+	if (!(output->changes & changes_primary))
+	    continue;
+	if (output->primary && output->output.xid != primary)
+	    changed = True;
+	else
+	    output->changes &= ~changes_primary;
+    }
+    for (c = 0; c < num_crtcs; c++)
+	if (crtcs[c].changing)
+	    changed = True;
+    if (fb_width != screen_width ||
+	fb_height != screen_height ||
+	fb_width_mm != screen_width_mm ||
+	fb_height_mm != screen_height_mm)
+	changed = True;
+    if (changed)
+	return;
+    if (verbose)
+	printf ("screen %d: configuration already in effect\n", screen);
+    exit (0);
+}
+
+/*
+ * Returns False when --optimistic has to start over, see batch_check()
+ */
+static Bool
+apply (void)
+{
+    int		    c;
+    struct timespec grabbed, released;
+    Bool	    applied;
     
-    for (o = 0; o < res->noutput; o++)
+    /*
+     * Crtcs which stay enabled must fit the new screen
+     * size in their old configuration, otherwise they
+     * have to be moved as well
+     */
+    for (c = 0; c < res->ncrtc; c++)
     {
-	XRROutputInfo	*output_info = XRRGetOutputInfo (dpy, res, res->outputs[o]);
-	output_t	*output;
-	name_t		output_name;
-	if (!output_info) fatal ("could not get output 0x%x information\n", res->outputs[o]);
-	set_name_xid (&output_name, res->outputs[o]);
-	set_name_index (&output_name, o);
-	set_name_string (&output_name, output_info->name);
-	output = find_output (&output_name);
-	if (!output)
-	{
-	    output = add_output ();
-	    set_name_all (&output->output, &output_name);
-	    /*
-	     * When global --automatic mode is set, turn on connected but off
-	     * outputs, turn off disconnected but on outputs
-	     */
-	    if (automatic)
-	    {
-		switch (output_info->connection) {
-		case RR_Connected:
-		    if (!output_info->crtc) {
-			output->changes |= changes_automatic;
-			output->automatic = True;
-		    }
-		    break;
-		case RR_Disconnected:
-		    if (output_info->crtc)
-		    {
-			output->changes |= changes_automatic;
-			output->automatic = True;
-		    }
-		    break;
-		}
-	    }
-	}
-	output->found = True;
+	crtc_t	    *crtc = &crtcs[c];
+	XRRCrtcInfo *crtc_info = crtc->crtc_info;
+	XRRModeInfo *old_mode;
+	int	    x, y, w, h;
+	box_t	    bounds;
+
+	if (crtc_info->mode == None || !crtc->mode_info) 
+	    continue;
+	
+	old_mode = find_mode_by_xid (crtc_info->mode);
+	if (!old_mode) 
+	    fatal ("cannot find mode 0x%lx of crtc %d\n",
+		   crtc_info->mode, crtc->crtc.index);
+	    
+	/* old position and size information */
+	mode_geometry (old_mode, crtc_info->rotation,
+		       &crtc->current_transform.transform,
+		       &bounds);
+
+	x = crtc_info->x + bounds.x1;
+	y = crtc_info->y + bounds.y1;
+	w = bounds.x2 - bounds.x1;
+	h = bounds.y2 - bounds.y1;
+
+	/* if it doesn't fit, it must be moved */
+	if (x + w > fb_width || y + h > fb_height) 
+	    crtc->changing = True;
+    }
+
+    /*
+     * Everything is worked out and reported before the server is
+     * grabbed, so that only the requests themselves are sent while
+     * it is held
+     */
+    apply_changes (True);
+    save_last_good ();
+    batch_begin ();
+
+    /*
+     * Hold the server grabbed while messing with
+     * the screen so that apps which notice the resize
+     * event and ask for xinerama information from the server
+     * receive up-to-date information
+     */
+    if (grab_server && !simulate_file)
+    {
+	clock_gettime (CLOCK_MONOTONIC, &grabbed);
+	XGrabServer (dpy);
+    }
+
+    if (optimistic)
+	batch_timestamp = res->timestamp;
+    apply_changes (False);
+    set_primary ();
+
+    /*
+     * Release the server grab and let all clients
+     * respond to the updated state. The ungrab is queued
+     * with the rest of the batch so the server holds the grab
+     * only while processing it; failures are reverted afterwards
+     */
+    if (grab_server && !simulate_file)
+	XUngrabServer (dpy);
 
+    applied = batch_check ();
+
+    if (grab_server && !simulate_file && verbose)
+    {
 	/*
-	 * Automatic mode -- track connection state and enable/disable outputs
-	 * as necessary
+	 * Seen from here, from queueing the grab to the reply of the
+	 * sync after the ungrab, so this includes a round trip; the
+	 * server held the grab for no longer than that
 	 */
-	if (output->automatic)
-	{
-	    switch (output_info->connection) {
-	    case RR_Connected:
-	    case RR_UnknownConnection:
-		if ((!(output->changes & changes_mode)))
-		{
-		    set_name_preferred (&output->mode);
-		    output->changes |= changes_mode;
-		}
-		break;
-	    case RR_Disconnected:
-		if ((!(output->changes & changes_mode)))
-		{
-		    set_name_xid (&output->mode, None);
-		    set_name_xid (&output->crtc, None);
-		    output->changes |= changes_mode;
-		    output->changes |= changes_crtc;
-		}
-		break;
-	    }
-	}
-
-	set_output_info (output, res->outputs[o], output_info);
+	clock_gettime (CLOCK_MONOTONIC, &released);
+	printf ("screen %d: server grabbed for at most %.3f ms (client-observed)\n",
+		screen,
+		(released.tv_sec - grabbed.tv_sec) * 1000.0 +
+		(released.tv_nsec - grabbed.tv_nsec) / 1000000.0);
     }
-    for (q = outputs; q; q = q->next)
+    return applied;
+}
+
+/*
+ * Whether the planned mode, position, rotation, outputs or transform
+ * of a crtc differ from its current ones
+ */
+static Bool
+crtc_config_changes (crtc_t *crtc)
+{
+    XRRCrtcInfo	*crtc_info = crtc->crtc_info;
+    int		o, l;
+
+    if (!crtc->mode_info)
+	return crtc_info->mode != None;
+    if (crtc->mode_info->id != crtc_info->mode ||
+	crtc->x != crtc_info->x || crtc->y != crtc_info->y ||
+	crtc->rotation != crtc_info->rotation ||
+	crtc->noutput != crtc_info->noutput)
+	return True;
+    for (o = 0; o < crtc->noutput; o++)
     {
-	if (!q->found)
-	{
-	    fprintf(stderr, "warning: output %s not found; ignoring\n",
-		    q->output.string);
-	}
+	for (l = 0; l < crtc_info->noutput; l++)
+	    if (crtc->outputs[o]->output.xid == crtc_info->outputs[l])
+		break;
+	if (l == crtc_info->noutput)
+	    return True;
     }
+    return !equal_transform (&crtc->current_transform, &crtc->pending_transform);
+}
+
+/* no panning is the same as an all zero one */
+static Bool
+equal_panning (XRRPanning *a, XRRPanning *b)
+{
+    XRRPanning	zero;
+
+    memset (&zero, '\0', sizeof (zero));
+    if (!a)
+	a = &zero;
+    if (!b)
+	b = &zero;
+    return !memcmp (&a->left, &b->left,
+		    sizeof (XRRPanning) - offsetof (XRRPanning, left));
+}
+
+/*
+ * Whether the planned configuration of a crtc differs from
+ * its current one
+ */
+static Bool
+crtc_plan_changes (crtc_t *crtc)
+{
+    return crtc_config_changes (crtc) ||
+	(crtc->mode_info &&
+	 !equal_panning (crtc->panning_info, crtc->current_panning));
 }
 
+/*
+ * --wait-settle: ask for RandR notifications before applying the
+ * changes, then wait until the server has reported every crtc and the
+ * screen size in their new state
+ */
+static struct timespec	settle_start;
+
 static void
-mark_changing_crtcs (void)
+settle_select (void)
 {
-    int	c;
+    if (!settle_timeout || dryrun)
+	return;
+    XRRSelectInput (dpy, root,
+		    RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
+    clock_gettime (CLOCK_MONOTONIC, &settle_start);
+}
+
+static double
+settle_elapsed (void)
+{
+    return elapsed_ms (&settle_start);
+}
 
+static void
+settle_wait (int event_base)
+{
+    Bool	    *waiting;
+    Bool	    screen_waiting;
+    int		    pending = 0;
+    int		    c, remaining;
+    XEvent	    event;
+    struct pollfd   pfd;
+
+    if (!settle_timeout || dryrun)
+	return;
+    waiting = calloc (num_crtcs, sizeof (Bool));
+    if (!waiting) fatal ("out of memory\n");
+    /*
+     * Crtcs which are only set again in the same state, to move
+     * panning or to fit the new screen, get no notification
+     */
     for (c = 0; c < num_crtcs; c++)
     {
-	crtc_t	    *crtc = &crtcs[c];
-	int	    o;
-	output_t    *output;
+	crtc_t	*crtc = &crtcs[c];
 
-	/* walk old output list (to catch disables) */
-	for (o = 0; o < crtc->crtc_info->noutput; o++)
+	if (crtc_config_changes (crtc))
 	{
-	    output = find_output_by_xid (crtc->crtc_info->outputs[o]);
-	    if (!output) fatal ("cannot find output 0x%x\n",
-				crtc->crtc_info->outputs[o]);
-	    if (output->changes)
-		crtc->changing = True;
+	    waiting[c] = True;
+	    pending++;
 	}
-	/* walk new output list */
-	for (o = 0; o < crtc->noutput; o++)
+    }
+    screen_waiting = fb_width != screen_width || fb_height != screen_height;
+    if (screen_waiting)
+	pending++;
+
+    while (pending)
+    {
+	while (pending && XPending (dpy))
 	{
-	    output = crtc->outputs[o];
-	    if (output->changes)
-		crtc->changing = True;
+	    XNextEvent (dpy, &event);
+	    XRRUpdateConfiguration (&event);
+	    if (event.type == event_base + RRScreenChangeNotify)
+	    {
+		XRRScreenChangeNotifyEvent *sce = (XRRScreenChangeNotifyEvent *) &event;
+
+		/* skip any intermediate size */
+		if (screen_waiting &&
+		    sce->width == fb_width && sce->height == fb_height)
+		{
+		    screen_waiting = False;
+		    pending--;
+		}
+	    }
+	    else if (event.type == event_base + RRNotify &&
+		     ((XRRNotifyEvent *) &event)->subtype == RRNotify_CrtcChange)
+	    {
+		XRRCrtcChangeNotifyEvent *cce = (XRRCrtcChangeNotifyEvent *) &event;
+		crtc_t *crtc = find_crtc_by_xid (cce->crtc);
+
+		if (crtc && waiting[crtc->crtc.index] &&
+		    cce->mode == (crtc->mode_info ? crtc->mode_info->id : None))
+		{
+		    waiting[crtc->crtc.index] = False;
+		    pending--;
+		}
+	    }
+	}
+	if (!pending)
+	    break;
+	remaining = settle_timeout - settle_elapsed ();
+	if (remaining <= 0)
+	{
+	    fprintf (stderr, "%s: configuration not settled after %d ms "
+		     "(%d notifications missing)\n",
+		     program_name, settle_timeout, pending);
+	    exit (1);
 	}
+	pfd.fd = ConnectionNumber (dpy);
+	pfd.events = POLLIN;
+	poll (&pfd, 1, remaining);
     }
+    printf ("screen %d: settled in %.3f ms\n", screen, settle_elapsed ());
 }
 
 /*
- * Test whether 'crtc' can be used for 'output'
+ * Use current output state to complete the output list
+ */
+#define TILE_PREFIX "tile:"
+
+/*
+ * Read the TILE property: group id, flags, number of tiles across and
+ * down, location of this tile and its size
  */
 static Bool
-check_crtc_for_output (crtc_t *crtc, output_t *output)
+output_tile (RROutput xid, tile_t *tile)
 {
-    int		c;
-    int		l;
-    output_t    *other;
-    
-    for (c = 0; c < output->output_info->ncrtc; c++)
-	if (output->output_info->crtcs[c] == crtc->crtc.xid)
-	    break;
-    if (c == output->output_info->ncrtc)
+    Atom	    name;
+    Atom	    actual_type;
+    int		    actual_format;
+    unsigned long   nitems, bytes_after;
+    unsigned char   *prop;
+    Bool	    ret = False;
+
+    if (simulate_file)
+    {
+	*tile = snapshot_output (xid)->tile;
+	return tile->group > 0;
+    }
+    name = XInternAtom (dpy, "TILE", True);
+    if (name == None)
 	return False;
-    for (other = outputs; other; other = other->next)
+    if (XRRGetOutputProperty (dpy, xid, name, 0, 8,
+			      False, False, AnyPropertyType,
+			      &actual_type, &actual_format,
+			      &nitems, &bytes_after, &prop) != Success)
+	return False;
+    if (actual_type == XA_INTEGER && actual_format == 32 && nitems == 8)
     {
-	if (other == output)
-	    continue;
+	long	*v = (long *) prop;
+
+	tile->group = v[0];
+	tile->flags = v[1];
+	tile->num_h = v[2];
+	tile->num_v = v[3];
+	tile->h_loc = v[4];
+	tile->v_loc = v[5];
+	tile->width = v[6];
+	tile->height = v[7];
+	ret = tile->num_h > 0 && tile->num_v > 0 &&
+	      tile->h_loc < tile->num_h && tile->v_loc < tile->num_v;
+    }
+    XFree (prop);
+    return ret;
+}
 
-	if (other->mode_info == NULL)
-	    continue;
+/*
+ * Native mode of a tile: a preferred mode of the tile size if there is
+ * one, otherwise the one closest to the requested rate, otherwise the
+ * fastest
+ */
+static XRRModeInfo *
+tile_mode (XRROutputInfo *output_info, tile_t *tile, double refresh)
+{
+    XRRModeInfo	*best = NULL;
+    int		m;
 
-	if (other->crtc_info != crtc)
-	    continue;
+    for (m = 0; m < output_info->nmode; m++)
+    {
+	XRRModeInfo *mode_info = find_mode_by_xid (output_info->modes[m]);
 
-	/* see if the output connected to the crtc can clone to this output */
-	for (l = 0; l < output->output_info->nclone; l++)
-	    if (output->output_info->clones[l] == other->output.xid)
-		break;
-	/* not on the list, can't clone */
-	if (l == output->output_info->nclone) 
-	    return False;
+	if (!mode_info || (int) mode_info->width != tile->width ||
+	    (int) mode_info->height != tile->height)
+	    continue;
+	if (m < output_info->npreferred && !refresh)
+	    return mode_info;
+	if (!best ||
+	    (refresh ?
+	     fabs (mode_refresh (mode_info) - refresh) <
+	     fabs (mode_refresh (best) - refresh) :
+	     mode_refresh (mode_info) > mode_refresh (best)))
+	    best = mode_info;
     }
+    return best;
+}
 
-    if (crtc->noutput)
+/*
+ * The enabled tile of a group nearest to tile h, v, or -1
+ */
+static int
+tile_nearest (output_t *group, int h, int v)
+{
+    int	t, best = -1, d, best_d = 0;
+
+    for (t = 0; t < group->tiles_h * group->tiles_v; t++)
     {
-	/* make sure the state matches */
-	if (crtc->mode_info != output->mode_info)
-	    return False;
-	if (crtc->x != output->x)
-	    return False;
-	if (crtc->y != output->y)
-	    return False;
-	if (crtc->rotation != output->rotation)
-	    return False;
-	if (!equal_transform (&crtc->current_transform, &output->transform))
-	    return False;
+	if (!group->tiles_on[t])
+	    continue;
+	d = abs (t % group->tiles_h - h) + abs (t / group->tiles_h - v);
+	if (best < 0 || d < best_d)
+	{
+	    best = t;
+	    best_d = d;
+	}
     }
-    return True;
+    return best;
 }
 
-static crtc_t *
-find_crtc_for_output (output_t *output)
+/*
+ * The first enabled tile of a group going 'steps' tiles from h, v
+ * in direction dh, dv, or -1
+ */
+static int
+tile_towards (output_t *group, int h, int v, int dh, int dv, int steps)
 {
-    int	    c;
-
-    for (c = 0; c < output->output_info->ncrtc; c++)
+    while (steps-- > 0)
     {
-	crtc_t	    *crtc;
-
-	crtc = find_crtc_by_xid (output->output_info->crtcs[c]);
-	if (!crtc) fatal ("cannot find crtc 0x%x\n", output->output_info->crtcs[c]);
-
-	if (check_crtc_for_output (crtc, output))
-	    return crtc;
+	h += dh;
+	v += dv;
+	if (group->tiles_on[v * group->tiles_h + h])
+	    return v * group->tiles_h + h;
     }
-    return NULL;
+    return -1;
 }
 
+/*
+ * A tiled monitor shows up as one output per tile, all sharing a TILE
+ * group. --output tile:<group> configures the whole monitor: each tile
+ * gets its native mode and is placed next to its neighbours, so all of
+ * it changes in the same apply(). Settings given for a single tile win
+ * over those of the group. The pseudo output is taken off the output
+ * list once it has been copied into the tiles.
+ */
 static void
-set_positions (void)
+expand_tile_groups (void)
 {
-    output_t	*output;
-    Bool	keep_going;
-    Bool	any_set;
-    int		min_x, min_y;
+    output_t	**prev, *group, *output;
+    output_t	*groups = NULL, *missing = NULL;
+    tile_t	*tiles = NULL;
+    int		o;
 
-    for (;;)
+    for (prev = &outputs; (group = *prev);)
     {
-	any_set = False;
-	keep_going = False;
-	for (output = outputs; output; output = output->next)
+	char	    *id_string = group->output.string + strlen (TILE_PREFIX);
+	char	    *end;
+	long	    id;
+	int	    h, v, t, anchor, anchor_h, anchor_v;
+	relation_t  relation = relation_left_of;
+	Bool	    off;
+
+	if (!(group->output.kind & name_string) ||
+	    strncmp (group->output.string, TILE_PREFIX, strlen (TILE_PREFIX)))
 	{
-	    output_t    *relation;
-	    name_t	relation_name;
+	    prev = &group->next;
+	    continue;
+	}
+	id = strtol (id_string, &end, 10);
+	if (end == id_string || *end || id <= 0)
+	    fatal ("invalid tile group \"%s\"\n", group->output.string);
+	if (group->changes & ~(changes_mode | changes_automatic |
+			       changes_relation | changes_position |
+			       changes_refresh | changes_gamma |
+			       changes_primary))
+	    fatal ("tile group %ld only takes mode, rate, position, gamma, brightness and primary settings\n", id);
+
+	/* unlink the pseudo output */
+	*prev = group->next;
+	if (outputs_tail == &group->next)
+	    outputs_tail = prev;
+
+	if (!tiles)
+	{
+	    tiles = calloc (res->noutput, sizeof (tile_t));
+	    if (!tiles) fatal ("out of memory\n");
+	    for (o = 0; o < res->noutput; o++)
+		if (!output_tile (res->outputs[o], &tiles[o]))
+		    tiles[o].group = 0;
+	}
 
-	    if (!(output->changes & changes_relation)) continue;
-	    
-	    if (output->mode_info == NULL) continue;
+	for (o = 0; o < res->noutput; o++)
+	{
+	    XRROutputInfo   *output_info;
+	    name_t	    output_name;
+	    tile_t	    *tile = &tiles[o];
 
-	    init_name (&relation_name);
-	    set_name_string (&relation_name, output->relative_to);
-	    relation = find_output (&relation_name);
-	    if (!relation) fatal ("cannot find output \"%s\"\n", output->relative_to);
-	    
-	    if (relation->mode_info == NULL) 
-	    {
-		output->x = 0;
-		output->y = 0;
-		output->changes |= changes_position;
-		any_set = True;
+	    if (tile->group != id)
 		continue;
+	    if (!group->tiles)
+	    {
+		group->tiles_h = tile->num_h;
+		group->tiles_v = tile->num_v;
+		group->tiles = calloc (tile->num_h * tile->num_v,
+				       sizeof (output_t *));
+		group->tiles_on = calloc (tile->num_h * tile->num_v,
+					  sizeof (Bool));
+		if (!group->tiles || !group->tiles_on)
+		    fatal ("out of memory\n");
 	    }
-	    /*
-	     * Make sure the dependent object has been set in place
-	     */
-	    if ((relation->changes & changes_relation) && 
-		!(relation->changes & changes_position))
+	    if (tile->num_h != group->tiles_h || tile->num_v != group->tiles_v)
+		fatal ("tile group %ld has inconsistent tile counts\n", id);
+
+	    output_info = get_output_info (res->outputs[o]);
+	    if (!output_info) fatal ("could not get output 0x%x information\n", res->outputs[o]);
+	    init_name (&output_name);
+	    set_name_xid (&output_name, res->outputs[o]);
+	    set_name_index (&output_name, o);
+	    set_name_string (&output_name, output_info->name);
+	    output = find_output (&output_name);
+	    if (!output)
 	    {
-		keep_going = True;
-		continue;
+		output = add_output ();
+		set_name_all (&output->output, &output_name);
 	    }
-	    
-	    switch (output->relation) {
-	    case relation_left_of:
-		output->y = relation->y;
-		output->x = relation->x - mode_width (output->mode_info, output->rotation);
-		break;
-	    case relation_right_of:
-		output->y = relation->y;
-		output->x = relation->x + mode_width (relation->mode_info, relation->rotation);
-		break;
-	    case relation_above:
-		output->x = relation->x;
-		output->y = relation->y - mode_height (output->mode_info, output->rotation);
-		break;
-	    case relation_below:
-		output->x = relation->x;
-		output->y = relation->y + mode_height (relation->mode_info, relation->rotation);
-		break;
-	    case relation_same_as:
-		output->x = relation->x;
-		output->y = relation->y;
+	    t = tile->v_loc * tile->num_h + tile->h_loc;
+	    group->tiles[t] = output;
+
+	    if ((group->changes & (changes_mode|changes_automatic)) &&
+		!(output->changes & changes_mode))
+	    {
+		if (group->automatic)
+		    off = output_info->connection == RR_Disconnected;
+		else
+		    off = group->mode.kind == name_xid && group->mode.xid == None;
+		if (off)
+		{
+		    set_name_xid (&output->mode, None);
+		    set_name_xid (&output->crtc, None);
+		}
+		else
+		{
+		    XRRModeInfo	*mode_info = tile_mode (output_info, tile,
+							group->refresh);
+
+		    if (!mode_info)
+			fatal ("output %s has no %dx%d mode for its tile\n",
+			       output_info->name, tile->width, tile->height);
+		    set_name_xid (&output->mode, mode_info->id);
+		    if (!(output->changes & changes_refresh))
+		    {
+			output->max_refresh = group->max_refresh;
+			output->refresh_cap = group->refresh_cap;
+		    }
+		}
+		output->changes |= changes_mode;
 	    }
-	    output->changes |= changes_position;
-	    any_set = True;
+	    if (output->changes & changes_mode)
+		group->tiles_on[t] = !(output->mode.kind == name_xid &&
+				       output->mode.xid == None);
+	    else
+		group->tiles_on[t] = output_info->crtc != None;
+	    if ((group->changes & changes_gamma) &&
+		!(output->changes & changes_gamma))
+	    {
+		output->gamma.red = group->gamma.red;
+		output->gamma.green = group->gamma.green;
+		output->gamma.blue = group->gamma.blue;
+		output->brightness = group->brightness;
+		output->brightness_set = group->brightness_set;
+		output->color_temp = group->color_temp;
+		output->changes |= changes_gamma;
+	    }
+	    /* output_info stays around, the tile is named by its string */
 	}
-	if (!keep_going)
-	    break;
-	if (!any_set)
-	    fatal ("loop in relative position specifications\n");
+	if (!group->tiles)
+	{
+	    warning ("tile group %ld not found; ignoring\n", id);
+	    group->next = missing;
+	    missing = group;
+	    continue;
+	}
+
+	for (o = 0; o < group->tiles_h * group->tiles_v; o++)
+	    if (!group->tiles[o])
+		fatal ("tile group %ld is missing tile %d,%d\n", id,
+		       o % group->tiles_h, o / group->tiles_h);
+
+	/*
+	 * The group position or relation goes to the enabled tile nearest
+	 * the corner on that side. Every other enabled tile is chained to
+	 * the nearest enabled one towards it along its row, or failing
+	 * that along its column; disabled tiles, like disconnected ones
+	 * --auto turns off, are left out of the chain
+	 */
+	anchor_h = group->relation == relation_left_of &&
+		   (group->changes & changes_relation) ? group->tiles_h - 1 : 0;
+	anchor_v = group->relation == relation_above &&
+		   (group->changes & changes_relation) ? group->tiles_v - 1 : 0;
+	anchor = tile_nearest (group, anchor_h, anchor_v);
+	if (anchor >= 0)
+	{
+	    anchor_h = anchor % group->tiles_h;
+	    anchor_v = anchor / group->tiles_h;
+	}
+	if (group->changes & changes_primary)
+	{
+	    group->tiles[0]->primary = group->primary;
+	    group->tiles[0]->changes |= changes_primary;
+	}
+	for (v = 0; v < group->tiles_v; v++)
+	    for (h = 0; h < group->tiles_h; h++)
+	    {
+		t = v * group->tiles_h + h;
+		output = group->tiles[t];
+		if (!group->tiles_on[t] ||
+		    (output->changes & (changes_relation|changes_position)))
+		    continue;
+		if (t == anchor)
+		{
+		    output->relation = group->relation;
+		    output->relative_to = group->relative_to;
+		    output->x = group->x;
+		    output->y = group->y;
+		    output->changes |= group->changes & (changes_relation|changes_position);
+		    continue;
+		}
+		t = -1;
+		if (h != anchor_h)
+		{
+		    t = tile_towards (group, h, v, h < anchor_h ? 1 : -1, 0,
+				      abs (anchor_h - h));
+		    relation = h < anchor_h ? relation_left_of : relation_right_of;
+		}
+		if (t < 0 && v != anchor_v)
+		{
+		    t = tile_towards (group, h, v, 0, v < anchor_v ? 1 : -1,
+				      abs (anchor_v - v));
+		    relation = v < anchor_v ? relation_above : relation_below;
+		}
+		/* nothing enabled between it and the anchor: leave it be */
+		if (t < 0)
+		    continue;
+		output->relation = relation;
+		output->relative_to = group->tiles[t]->output.string;
+		output->changes |= changes_relation;
+	    }
+	if (verbose)
+	    printf ("tile group %ld: %dx%d tiles\n", id,
+		    group->tiles_h, group->tiles_v);
+	group->next = groups;
+	groups = group;
     }
 
     /*
-     * Now normalize positions so the upper left corner of all outputs is at 0,0
+     * Outputs placed relative to a group go next to its edge tiles
      */
-    min_x = 32768;
-    min_y = 32768;
-    for (output = outputs; output; output = output->next)
-    {
-	if (output->mode_info == NULL) continue;
-	
-	if (output->x < min_x) min_x = output->x;
-	if (output->y < min_y) min_y = output->y;
-    }
-    if (min_x || min_y)
-    {
-	/* move all outputs */
+    for (group = groups; group; group = group->next)
 	for (output = outputs; output; output = output->next)
 	{
-	    if (output->mode_info == NULL) continue;
+	    int	t;
 
-	    output->x -= min_x;
-	    output->y -= min_y;
-	    output->changes |= changes_position;
+	    if (!(output->changes & changes_relation) ||
+		strcmp (output->relative_to, group->output.string))
+		continue;
+	    switch (output->relation) {
+	    case relation_right_of:
+		t = tile_nearest (group, group->tiles_h - 1, 0);
+		break;
+	    case relation_below:
+		t = tile_nearest (group, 0, group->tiles_v - 1);
+		break;
+	    default:
+		t = tile_nearest (group, 0, 0);
+		break;
+	    }
+	    if (t < 0)
+		fatal ("output %s is placed relative to %s, a tile group with no enabled tile\n",
+		       output->output.string, group->output.string);
+	    output->relative_to = group->tiles[t]->output.string;
 	}
-    }
+    for (group = missing; group; group = group->next)
+	for (output = outputs; output; output = output->next)
+	    if ((output->changes & changes_relation) &&
+		!strcmp (output->relative_to, group->output.string))
+		fatal ("output %s is placed relative to %s, a tile group which was not found\n",
+		       output->output.string, group->output.string);
+    free (tiles);
 }
 
 static void
-set_screen_size (void)
+get_outputs (void)
 {
-    output_t	*output;
-    Bool	fb_specified = fb_width != 0 && fb_height != 0;
+    int		o;
+    output_t    *q;
     
-    for (output = outputs; output; output = output->next)
+    expand_tile_groups ();
+    for (o = 0; o < res->noutput; o++)
     {
-	XRRModeInfo *mode_info = output->mode_info;
-	int	    x, y, w, h;
-	box_t	    bounds;
-	
-	if (!mode_info) continue;
-	
-	mode_geometry (mode_info, output->rotation,
-		       &output->transform.transform,
-		       &bounds);
-	x = output->x + bounds.x1;
-	y = output->y + bounds.y1;
-	w = bounds.x2 - bounds.x1;
-	h = bounds.y2 - bounds.y1;
-	/* make sure output fits in specified size */
-	if (fb_specified)
+	XRROutputInfo	*output_info = get_output_info (res->outputs[o]);
+	output_t	*output;
+	name_t		output_name;
+	if (!output_info) fatal ("could not get output 0x%x information\n", res->outputs[o]);
+	set_name_xid (&output_name, res->outputs[o]);
+	set_name_index (&output_name, o);
+	set_name_string (&output_name, output_info->name);
+	output = find_output (&output_name);
+	if (!output)
 	{
-	    if (x + w > fb_width || y + h > fb_height)
-		warning ("specified screen %dx%d not large enough for output %s (%dx%d+%d+%d)\n",
-			 fb_width, fb_height, output->output.string, w, h, x, y);
+	    output = add_output ();
+	    set_name_all (&output->output, &output_name);
+	    /*
+	     * When global --automatic mode is set, turn on connected but off
+	     * outputs, turn off disconnected but on outputs
+	     */
+	    if (automatic)
+	    {
+		switch (output_info->connection) {
+		case RR_Connected:
+		    if (!output_info->crtc) {
+			output->changes |= changes_automatic;
+			output->automatic = True;
+		    }
+		    break;
+		case RR_Disconnected:
+		    if (output_info->crtc)
+		    {
+			output->changes |= changes_automatic;
+			output->automatic = True;
+		    }
+		    break;
+		}
+	    }
 	}
-	/* fit fb to output */
-	else
+	output->found = True;
+
+	/*
+	 * Automatic mode -- track connection state and enable/disable outputs
+	 * as necessary
+	 */
+	if (output->automatic)
 	{
-	    XRRPanning *pan;
-	    if (x + w > fb_width)
-		fb_width = x + w;
-	    if (y + h > fb_height)
-		fb_height = y + h;
-	    if (output->changes & changes_panning)
-		pan = &output->panning;
-	    else
-		pan = output->crtc_info ? output->crtc_info->panning_info : NULL;
-	    if (pan && pan->left + pan->width > fb_width)
-		fb_width = pan->left + pan->width;
-	    if (pan && pan->top + pan->height > fb_height)
-		fb_height = pan->top + pan->height;
+	    switch (output_info->connection) {
+	    case RR_Connected:
+	    case RR_UnknownConnection:
+		if ((!(output->changes & changes_mode)))
+		{
+		    set_name_preferred (&output->mode);
+		    output->changes |= changes_mode;
+		}
+		break;
+	    case RR_Disconnected:
+		if ((!(output->changes & changes_mode)))
+		{
+		    set_name_xid (&output->mode, None);
+		    set_name_xid (&output->crtc, None);
+		    output->changes |= changes_mode;
+		    output->changes |= changes_crtc;
+		}
+		break;
+	    }
 	}
-    }	
 
-    if (fb_width > maxWidth || fb_height > maxHeight)
-        fatal ("screen cannot be larger than %dx%d (desired size %dx%d)\n",
-	       maxWidth, maxHeight, fb_width, fb_height);
-    if (fb_specified)
+	set_output_info (output, res->outputs[o], output_info);
+    }
+    for (q = outputs; q; q = q->next)
     {
-	if (fb_width < minWidth || fb_height < minHeight)
-	    fatal ("screen must be at least %dx%d\n", minWidth, minHeight);
+	if (!q->found)
+	{
+	    fprintf(stderr, "warning: output %s not found; ignoring\n",
+		    q->output.string);
+	}
     }
-    else
+}
+
+static void
+mark_changing_crtcs (void)
+{
+    int	c;
+
+    for (c = 0; c < num_crtcs; c++)
     {
-	if (fb_width < minWidth) fb_width = minWidth;
-	if (fb_height < minHeight) fb_height = minHeight;
+	crtc_t	    *crtc = &crtcs[c];
+	int	    o;
+	output_t    *output;
+
+	/* walk old output list (to catch disables) */
+	for (o = 0; o < crtc->crtc_info->noutput; o++)
+	{
+	    output = find_output_by_xid (crtc->crtc_info->outputs[o]);
+	    if (!output) fatal ("cannot find output 0x%x\n",
+				crtc->crtc_info->outputs[o]);
+	    if (output->changes)
+		crtc->changing = True;
+	}
+	/* walk new output list */
+	for (o = 0; o < crtc->noutput; o++)
+	{
+	    output = crtc->outputs[o];
+	    if (output->changes)
+		crtc->changing = True;
+	}
+	/* leave it alone when it already is as requested */
+	if (crtc->changing && !crtc_plan_changes (crtc))
+	    crtc->changing = False;
     }
 }
+
+/*
+ * Test whether 'crtc' can be used for 'output'
+ */
+static Bool
+check_crtc_for_output (crtc_t *crtc, output_t *output)
+{
+    int		c;
+    int		l;
+    output_t    *other;
     
+    for (c = 0; c < output->output_info->ncrtc; c++)
+	if (output->output_info->crtcs[c] == crtc->crtc.xid)
+	    break;
+    if (c == output->output_info->ncrtc)
+	return False;
+    for (other = outputs; other; other = other->next)
+    {
+	if (other == output)
+	    continue;
 
-static void
-disable_outputs (output_t *outputs)
+	if (other->mode_info == NULL)
+	    continue;
+
+	if (other->crtc_info != crtc)
+	    continue;
+
+	/* see if the output connected to the crtc can clone to this output */
+	for (l = 0; l < output->output_info->nclone; l++)
+	    if (output->output_info->clones[l] == other->output.xid)
+		break;
+	/* not on the list, can't clone */
+	if (l == output->output_info->nclone) 
+	    return False;
+    }
+
+    if (crtc->noutput)
+    {
+	/* make sure the state matches */
+	if (crtc->mode_info != output->mode_info)
+	    return False;
+	if (crtc->x != output->x)
+	    return False;
+	if (crtc->y != output->y)
+	    return False;
+	if (crtc->rotation != output->rotation)
+	    return False;
+	if (!equal_transform (&crtc->current_transform, &output->transform))
+	    return False;
+    }
+    return True;
+}
+
+static crtc_t *
+find_crtc_for_output (output_t *output)
+{
+    int	    c;
+
+    for (c = 0; c < output->output_info->ncrtc; c++)
+    {
+	crtc_t	    *crtc;
+
+	crtc = find_crtc_by_xid (output->output_info->crtcs[c]);
+	if (!crtc) fatal ("cannot find crtc 0x%x\n", output->output_info->crtcs[c]);
+
+	if (check_crtc_for_output (crtc, output))
+	    return crtc;
+    }
+    return NULL;
+}
+
+/*
+ * Scale every enabled output so that the framebuffer has roughly
+ * auto_scale_dpi pixels per inch on it. Factors are multiples of 1/8
+ * so that integer ratios stay exact, and of the factors within 5% of
+ * the target the smallest one wins, keeping the framebuffer small
+ */
+static void
+set_auto_scale (void)
+{
+    output_t	*output;
+
+    if (auto_scale_dpi <= 0)
+	return;
+
+    for (output = outputs; output; output = output->next)
+    {
+	XRROutputInfo	*output_info = output->output_info;
+	double		mm_w, mm_h, native, scale, best = 0;
+	int		k;
+
+	if (!output->mode_info || !output_info)
+	    continue;
+	/* leave explicit --scale, --scale-from and --transform alone */
+	if (output->changes & changes_transform)
+	    continue;
+	if (!output_info->mm_width || !output_info->mm_height)
+	{
+	    if (verbose)
+		printf ("auto-scale: %s has no physical size, not scaled\n",
+			output->output.string);
+	    continue;
+	}
+
+	/* the transform applies after rotation */
+	if (output->rotation & (RR_Rotate_90|RR_Rotate_270))
+	{
+	    mm_w = output_info->mm_height;
+	    mm_h = output_info->mm_width;
+	}
+	else
+	{
+	    mm_w = output_info->mm_width;
+	    mm_h = output_info->mm_height;
+	}
+	native = (25.4 * mode_width (output->mode_info, output->rotation) / mm_w +
+		  25.4 * mode_height (output->mode_info, output->rotation) / mm_h) / 2;
+
+	/*
+	 * The scaled size, and with it the screen, grows with the factor,
+	 * so the smallest factor within 5% of the target gives the
+	 * smallest screen; failing that, take the one nearest the target
+	 */
+	for (k = 1; k <= 32; k++)
+	{
+	    scale = k / 8.0;
+	    if (fabs (native * scale - auto_scale_dpi) <= auto_scale_dpi * 0.05)
+	    {
+		best = scale;
+		break;
+	    }
+	    if (!best || fabs (native * scale - auto_scale_dpi) <
+			 fabs (native * best - auto_scale_dpi))
+		best = scale;
+	}
+
+	init_transform (&output->transform);
+	output->transform.transform.matrix[0][0] = XDoubleToFixed (best);
+	output->transform.transform.matrix[1][1] = XDoubleToFixed (best);
+	output->transform.transform.matrix[2][2] = XDoubleToFixed (1.0);
+	output->transform.filter =
+	    transform_filter (&output->transform.transform,
+			      best != 1 ? "bilinear" : "nearest");
+	output->changes |= changes_transform;
+	if (verbose)
+	    printf ("auto-scale: %s %.0fdpi, scale %gx%g -> %.0fdpi, %.0fx%.0f, filter %s\n",
+		    output->output.string, native, best, best, native * best,
+		    ceil (mode_width (output->mode_info, output->rotation) * best),
+		    ceil (mode_height (output->mode_info, output->rotation) * best),
+		    output->transform.filter);
+    }
+}
+
+/*
+ * Place the outputs named by --layout in a grid, filling each row from
+ * left to right. Every column is as wide as its widest output and every
+ * row as tall as its tallest one, using the transformed bounds so that
+ * scaled and rotated outputs line up; the bezel is added between cells.
+ */
+static void
+set_layout (void)
+{
+    int		*column_x, *row_y;
+    int		i;
+
+    if (layout == layout_none)
+	return;
+
+    column_x = calloc (layout_columns + 1, sizeof (int));
+    row_y = calloc (layout_rows + 1, sizeof (int));
+    if (!column_x || !row_y) fatal ("out of memory\n");
+
+    /* size the cells */
+    for (i = 0; i < layout_noutput; i++)
+    {
+	output_t    *output = layout_outputs[i];
+	int	    column = i % layout_columns;
+	int	    row = i / layout_columns;
+	box_t	    bounds;
+
+	if (!output->mode_info) continue;
+
+	mode_geometry (output->mode_info, output->rotation,
+		       &output->transform.transform, &bounds);
+	if (bounds.x2 - bounds.x1 > column_x[column + 1])
+	    column_x[column + 1] = bounds.x2 - bounds.x1;
+	if (bounds.y2 - bounds.y1 > row_y[row + 1])
+	    row_y[row + 1] = bounds.y2 - bounds.y1;
+    }
+
+    /* turn cell sizes into cell origins */
+    for (i = 1; i <= layout_columns; i++)
+	column_x[i] += column_x[i - 1] + layout_bezel_x;
+    for (i = 1; i <= layout_rows; i++)
+	row_y[i] += row_y[i - 1] + layout_bezel_y;
+
+    for (i = 0; i < layout_noutput; i++)
+    {
+	output_t    *output = layout_outputs[i];
+	box_t	    bounds;
+
+	if (!output->mode_info) continue;
+
+	mode_geometry (output->mode_info, output->rotation,
+		       &output->transform.transform, &bounds);
+	output->x = column_x[i % layout_columns] - bounds.x1;
+	output->y = row_y[i / layout_columns] - bounds.y1;
+	output->changes &= ~changes_relation;
+	output->changes |= changes_position;
+	if (verbose)
+	    printf ("layout: %s at +%d+%d\n", output->output.string,
+		    output->x, output->y);
+    }
+    free (column_x);
+    free (row_y);
+}
+
+/*
+ * Parse --layout grid:<cols>x<rows>[:bezel=<h>,<v>], row[:bezel=<h>] or
+ * column[:bezel=<v>] along with the comma separated list of outputs
+ */
+static void
+parse_layout (char *spec, char *list)
+{
+    char    *name, *bezel;
+    int	    n;
+
+    if (!strncmp (spec, "grid:", 5))
+    {
+	layout = layout_grid;
+	if (sscanf (spec + 5, "%dx%d%n", &layout_columns, &layout_rows, &n) != 2)
+	    usage ();
+	if (layout_columns <= 0 || layout_rows <= 0)
+	    usage ();
+	bezel = spec + 5 + n;
+    }
+    else if (!strncmp (spec, "row", 3))
+    {
+	layout = layout_row;
+	bezel = spec + 3;
+    }
+    else if (!strncmp (spec, "column", 6))
+    {
+	layout = layout_column;
+	bezel = spec + 6;
+    }
+    else
+	usage ();
+
+    layout_bezel_x = layout_bezel_y = 0;
+    if (*bezel)
+    {
+	if (sscanf (bezel, ":bezel=%d%n", &layout_bezel_x, &n) != 1)
+	    usage ();
+	bezel += n;
+	if (*bezel == ',')
+	{
+	    /* rows and columns only have gaps in one direction */
+	    if (layout != layout_grid ||
+		sscanf (bezel, ",%d%n", &layout_bezel_y, &n) != 1)
+		usage ();
+	    bezel += n;
+	}
+	else if (layout == layout_column)
+	{
+	    layout_bezel_y = layout_bezel_x;
+	    layout_bezel_x = 0;
+	}
+	else if (layout == layout_grid)
+	    layout_bezel_y = layout_bezel_x;
+	if (*bezel != '\0' || layout_bezel_x < 0 || layout_bezel_y < 0)
+	    usage ();
+    }
+
+    layout_noutput = 0;
+    for (name = strtok (strdup (list), ","); name; name = strtok (NULL, ","))
+    {
+	output_t    *output = find_output_by_name (name);
+
+	if (!output)
+	{
+	    output = add_output ();
+	    set_name (&output->output, name, name_string|name_xid);
+	}
+	layout_outputs = realloc (layout_outputs,
+				  (layout_noutput + 1) * sizeof (output_t *));
+	if (!layout_outputs) fatal ("out of memory\n");
+	layout_outputs[layout_noutput++] = output;
+    }
+    if (!layout_noutput)
+	usage ();
+
+    switch (layout) {
+    case layout_row:
+	layout_columns = layout_noutput;
+	layout_rows = 1;
+	break;
+    case layout_column:
+	layout_columns = 1;
+	layout_rows = layout_noutput;
+	break;
+    default:
+	if (layout_noutput > layout_columns * layout_rows)
+	    fatal ("%d outputs do not fit in a %dx%d layout\n",
+		   layout_noutput, layout_columns, layout_rows);
+	break;
+    }
+}
+
+/*
+ * Read link and provider bandwidth budgets. Each line holds one of
+ *
+ *	total <Mbit/s>
+ *	provider <name> <Mbit/s>
+ *	link <output>[,<output>...] <Mbit/s>
+ *	link mst:<id> <Mbit/s>
+ *
+ * where mst:<id> names every output whose PATH property puts it
+ * behind the DisplayPort MST branch <id>
+ */
+static void
+read_budgets (char *filename)
+{
+    FILE    *f = fopen (filename, "r");
+    char    line[1024];
+    int	    lineno = 0;
+    budget_t **tail = &budgets;
+
+    if (!f)
+	fatal ("cannot open %s\n", filename);
+    while (fgets (line, sizeof (line), f))
+    {
+	char	    kind[32], name[1000];
+	double	    mbits;
+	budget_t    *budget;
+	char	    *p;
+
+	lineno++;
+	if ((p = strchr (line, '#')))
+	    *p = '\0';
+	if (sscanf (line, "%31s", kind) != 1)
+	    continue;
+
+	budget = calloc (1, sizeof (budget_t));
+	if (!budget) fatal ("out of memory\n");
+	if (!strcmp (kind, "total") && sscanf (line, "%*s %lf", &mbits) == 1)
+	{
+	    budget->kind = budget_total;
+	    budget->name = "total";
+	}
+	else if (!strcmp (kind, "provider") &&
+		 sscanf (line, "%*s %999s %lf", name, &mbits) == 2)
+	{
+	    budget->kind = budget_provider;
+	    budget->name = strdup (name);
+	}
+	else if (!strcmp (kind, "link") &&
+		 sscanf (line, "%*s %999s %lf", name, &mbits) == 2)
+	{
+	    budget->kind = budget_link;
+	    budget->name = strdup (name);
+	    for (p = strtok (strdup (name), ","); p; p = strtok (NULL, ","))
+	    {
+		budget->outputs = realloc (budget->outputs,
+					   (budget->noutput + 1) * sizeof (char *));
+		if (!budget->outputs) fatal ("out of memory\n");
+		budget->outputs[budget->noutput++] = p;
+	    }
+	}
+	else
+	    fatal ("%s:%d: cannot parse budget\n", filename, lineno);
+	if (mbits <= 0)
+	    fatal ("%s:%d: budget must be positive\n", filename, lineno);
+	budget->limit = mbits * 1e6;
+	*tail = budget;
+	tail = &budget->next;
+    }
+    fclose (f);
+}
+
+/*
+ * Fetch a string property of an output, or NULL when it isn't there
+ */
+static char *
+output_string_property (output_t *output, const char *property)
+{
+    Atom	    name;
+    Atom	    actual_type;
+    int		    actual_format;
+    unsigned long   nitems, bytes_after;
+    unsigned char   *prop;
+    char	    *value = NULL;
+
+    if (simulate_file)
+	return strcmp (property, "PATH") ? NULL :
+	    snapshot_output (output->output.xid)->path;
+    name = XInternAtom (dpy, property, True);
+    if (name == None)
+	return NULL;
+    if (XRRGetOutputProperty (dpy, output->output.xid, name, 0, 256,
+			      False, False, XA_STRING,
+			      &actual_type, &actual_format,
+			      &nitems, &bytes_after, &prop) != Success)
+	return NULL;
+    if (actual_type == XA_STRING && actual_format == 8)
+    {
+	value = malloc (nitems + 1);
+	if (!value) fatal ("out of memory\n");
+	memcpy (value, prop, nitems);
+	value[nitems] = '\0';
+    }
+    XFree (prop);
+    return value;
+}
+
+/*
+ * Bits per color component sent over the link, taken from
+ * the 'max bpc' property when the driver exposes it
+ */
+static int
+output_bpc (output_t *output)
+{
+    Atom	    name;
+    Atom	    actual_type;
+    int		    actual_format;
+    unsigned long   nitems, bytes_after;
+    unsigned char   *prop;
+    int		    bpc = 8;
+
+    if (simulate_file)
+	return snapshot_output (output->output.xid)->bpc;
+    name = XInternAtom (dpy, "max bpc", True);
+    if (name == None)
+	return bpc;
+    if (XRRGetOutputProperty (dpy, output->output.xid, name, 0, 1,
+			      False, False, AnyPropertyType,
+			      &actual_type, &actual_format,
+			      &nitems, &bytes_after, &prop) != Success)
+	return bpc;
+    if ((actual_type == XA_INTEGER || actual_type == XA_CARDINAL) &&
+	actual_format == 32 && nitems == 1 && *(long *) prop > 0)
+	bpc = *(long *) prop;
+    XFree (prop);
+    return bpc;
+}
+
+/* link bandwidth in bits per second */
+static double
+mode_bandwidth (XRRModeInfo *mode_info, int bpc)
+{
+    return (double) mode_info->dotClock * bpc * 3;
+}
+
+static Bool
+budget_has_output (budget_t *budget, output_t *output)
+{
+    int	    o;
+
+    switch (budget->kind) {
+    case budget_total:
+	return True;
+    case budget_provider:
+	for (o = 0; o < budget->nprovider_output; o++)
+	    if (budget->provider_outputs[o] == output->output.xid)
+		return True;
+	return False;
+    case budget_link:
+	for (o = 0; o < budget->noutput; o++)
+	{
+	    char    *name = budget->outputs[o];
+
+	    if (!strcmp (name, output->output.string))
+		return True;
+	    /* PATH is mst:<branch id>-<port>[-<port>...] */
+	    if (!strncmp (name, "mst:", 4) && output->path &&
+		!strncmp (output->path, name, strlen (name)) &&
+		output->path[strlen (name)] == '-')
+		return True;
+	}
+	return False;
+    }
+    return False;
+}
+
+static double
+budget_usage (budget_t *budget)
+{
+    output_t	*output;
+    double	usage = 0;
+
+    for (output = outputs; output; output = output->next)
+	if (output->mode_info && output->bpc &&
+	    budget_has_output (budget, output))
+	    usage += mode_bandwidth (output->mode_info, output->bpc);
+    return usage;
+}
+
+/*
+ * Find the fastest mode of the same size as the current one which
+ * needs less bandwidth, so that positions and the screen size stay
+ * the same when it gets substituted
+ */
+static XRRModeInfo *
+cheaper_mode (output_t *output)
+{
+    XRROutputInfo   *output_info = output->output_info;
+    XRRModeInfo	    *current = output->mode_info;
+    XRRModeInfo	    *best = NULL;
+    int		    m;
+
+    for (m = 0; m < output_info->nmode; m++)
+    {
+	XRRModeInfo *mode = find_mode_by_xid (output_info->modes[m]);
+
+	if (!mode || mode->width != current->width ||
+	    mode->height != current->height)
+	    continue;
+	if (mode->dotClock >= current->dotClock)
+	    continue;
+	if ((mode->modeFlags & (RR_Interlace|RR_DoubleScan)) !=
+	    (current->modeFlags & (RR_Interlace|RR_DoubleScan)))
+	    continue;
+	if (!best || mode_refresh (mode) > mode_refresh (best) ||
+	    (mode_refresh (mode) == mode_refresh (best) &&
+	     mode->dotClock < best->dotClock))
+	    best = mode;
+    }
+    return best;
+}
+
+/*
+ * Make sure the planned modes fit within the link and provider
+ * budgets, optionally trading refresh rate or blanking for bandwidth
+ */
+static void
+check_bandwidth (void)
+{
+    budget_t	*budget;
+    output_t	*output;
+
+    if (!budgets)
+	return;
+
+    for (output = outputs; output; output = output->next)
+    {
+	if (!output->mode_info)
+	    continue;
+	output->bpc = output_bpc (output);
+	output->path = output_string_property (output, "PATH");
+    }
+
+    for (budget = budgets; budget; budget = budget->next)
+    {
+	double	usage;
+
+	if (budget->kind == budget_provider)
+	{
+	    XRRProviderResources    *pr;
+	    int			    p;
+	    Bool		    found = False;
+
+	    if (!has_1_4)
+		fatal ("provider budgets need RandR 1.4\n");
+	    if (simulate_file)
+		fatal ("provider budgets cannot be simulated\n");
+	    pr = XRRGetProviderResources (dpy, root);
+	    for (p = 0; pr && p < pr->nproviders; p++)
+	    {
+		XRRProviderInfo	*info = XRRGetProviderInfo (dpy, res,
+							    pr->providers[p]);
+
+		if (info && !strcmp (info->name, budget->name))
+		{
+		    found = True;
+		    budget->nprovider_output = info->noutputs;
+		    /* malloc (0) may return NULL */
+		    if (info->noutputs)
+		    {
+			budget->provider_outputs = malloc (info->noutputs * sizeof (RROutput));
+			if (!budget->provider_outputs) fatal ("out of memory\n");
+			memcpy (budget->provider_outputs, info->outputs,
+				info->noutputs * sizeof (RROutput));
+		    }
+		}
+		if (info)
+		    XRRFreeProviderInfo (info);
+	    }
+	    if (pr)
+		XRRFreeProviderResources (pr);
+	    if (!found)
+		fatal ("cannot find provider \"%s\"\n", budget->name);
+	}
+
+	while ((usage = budget_usage (budget)) > budget->limit)
+	{
+	    output_t	*best_output = NULL;
+	    XRRModeInfo	*best_mode = NULL;
+	    double	best_loss = 0;
+
+	    if (!fit_bandwidth)
+		fatal ("outputs on %s need %.0f Mbit/s, budget is %.0f Mbit/s\n",
+		       budget->name, usage / 1e6, budget->limit / 1e6);
+
+	    /* give up as little refresh rate as possible */
+	    for (output = outputs; output; output = output->next)
+	    {
+		XRRModeInfo *mode;
+		double	    loss;
+
+		if (!output->mode_info || !budget_has_output (budget, output))
+		    continue;
+		mode = cheaper_mode (output);
+		if (!mode)
+		    continue;
+		loss = mode_refresh (output->mode_info) - mode_refresh (mode);
+		if (!best_mode || loss < best_loss)
+		{
+		    best_output = output;
+		    best_mode = mode;
+		    best_loss = loss;
+		}
+	    }
+	    if (!best_mode)
+		fatal ("cannot fit outputs on %s in %.0f Mbit/s (need %.0f Mbit/s)\n",
+		       budget->name, budget->limit / 1e6, usage / 1e6);
+
+	    printf ("output %s: %s %.2fHz (%.1fMHz) -> %s %.2fHz (%.1fMHz) to fit %s budget\n",
+		    best_output->output.string,
+		    best_output->mode_info->name,
+		    mode_refresh (best_output->mode_info),
+		    (double) best_output->mode_info->dotClock / 1e6,
+		    best_mode->name, mode_refresh (best_mode),
+		    (double) best_mode->dotClock / 1e6,
+		    budget->name);
+	    best_output->mode_info = best_mode;
+	    init_name (&best_output->mode);
+	    set_name_xid (&best_output->mode, best_mode->id);
+	    best_output->changes |= changes_mode;
+	}
+	if (verbose)
+	    printf ("bandwidth: %s %.0f of %.0f Mbit/s\n", budget->name,
+		    usage / 1e6, budget->limit / 1e6);
+    }
+}
+
+static void
+set_positions (void)
+{
+    output_t	*output;
+    Bool	keep_going;
+    Bool	any_set;
+    int		min_x, min_y;
+
+    for (;;)
+    {
+	any_set = False;
+	keep_going = False;
+	for (output = outputs; output; output = output->next)
+	{
+	    output_t    *relation;
+	    name_t	relation_name;
+	    box_t	bounds, relation_bounds;
+
+	    if (!(output->changes & changes_relation)) continue;
+	    
+	    if (output->mode_info == NULL) continue;
+
+	    init_name (&relation_name);
+	    set_name_string (&relation_name, output->relative_to);
+	    relation = find_output (&relation_name);
+	    if (!relation) fatal ("cannot find output \"%s\"\n", output->relative_to);
+	    
+	    if (relation->mode_info == NULL) 
+	    {
+		output->x = 0;
+		output->y = 0;
+		output->changes |= changes_position;
+		any_set = True;
+		continue;
+	    }
+	    /*
+	     * Make sure the dependent object has been set in place
+	     */
+	    if ((relation->changes & changes_relation) && 
+		!(relation->changes & changes_position))
+	    {
+		keep_going = True;
+		continue;
+	    }
+	    
+	    /*
+	     * Place the transformed bounds next to each other, so that
+	     * scaled outputs (--scale or --auto-scale) don't overlap
+	     */
+	    mode_geometry (output->mode_info, output->rotation,
+			   &output->transform.transform, &bounds);
+	    mode_geometry (relation->mode_info, relation->rotation,
+			   &relation->transform.transform, &relation_bounds);
+	    switch (output->relation) {
+	    case relation_left_of:
+		output->y = relation->y + relation_bounds.y1 - bounds.y1;
+		output->x = relation->x + relation_bounds.x1 - bounds.x2;
+		break;
+	    case relation_right_of:
+		output->y = relation->y + relation_bounds.y1 - bounds.y1;
+		output->x = relation->x + relation_bounds.x2 - bounds.x1;
+		break;
+	    case relation_above:
+		output->x = relation->x + relation_bounds.x1 - bounds.x1;
+		output->y = relation->y + relation_bounds.y1 - bounds.y2;
+		break;
+	    case relation_below:
+		output->x = relation->x + relation_bounds.x1 - bounds.x1;
+		output->y = relation->y + relation_bounds.y2 - bounds.y1;
+		break;
+	    case relation_same_as:
+		output->x = relation->x;
+		output->y = relation->y;
+	    }
+	    output->changes |= changes_position;
+	    any_set = True;
+	}
+	if (!keep_going)
+	    break;
+	if (!any_set)
+	    fatal ("loop in relative position specifications\n");
+    }
+
+    /*
+     * Now normalize positions so the upper left corner of all outputs is at 0,0
+     */
+    min_x = 32768;
+    min_y = 32768;
+    for (output = outputs; output; output = output->next)
+    {
+	if (output->mode_info == NULL) continue;
+	
+	if (output->x < min_x) min_x = output->x;
+	if (output->y < min_y) min_y = output->y;
+    }
+    if (min_x || min_y)
+    {
+	/* move all outputs */
+	for (output = outputs; output; output = output->next)
+	{
+	    if (output->mode_info == NULL) continue;
+
+	    output->x -= min_x;
+	    output->y -= min_y;
+	    output->changes |= changes_position;
+	}
+    }
+}
+
+/*
+ * Estimate the memory used by a screen of the given size, using
+ * the pixmap format of the root window depth
+ */
+static void
+pixmap_format (int *bpp, int *pad)
+{
+    XPixmapFormatValues *formats;
+    int			nformat, f;
+
+    *bpp = snapshot_bpp;
+    *pad = snapshot_pad;
+    if (simulate_file)
+	return;
+    formats = XListPixmapFormats (dpy, &nformat);
+    for (f = 0; formats && f < nformat; f++)
+	if (formats[f].depth == DefaultDepth (dpy, screen))
+	{
+	    *bpp = formats[f].bits_per_pixel;
+	    *pad = formats[f].scanline_pad;
+	}
+    if (formats)
+	XFree (formats);
+}
+
+static double
+fb_bytes (int width, int height)
+{
+    static int	bpp, pad;
+
+    if (!bpp)
+	pixmap_format (&bpp, &pad);
+    return (double) ((width * bpp + pad - 1) / pad) * (pad / 8) * height;
+}
+
+static void
+set_screen_size (void)
+{
+    output_t	*output;
+    Bool	fb_specified = fb_width != 0 && fb_height != 0;
+    int		need_width = 0, need_height = 0;
+    
+    for (output = outputs; output; output = output->next)
+    {
+	XRRModeInfo *mode_info = output->mode_info;
+	int	    x, y, w, h;
+	box_t	    bounds;
+	XRRPanning  *pan;
+	
+	if (!mode_info) continue;
+	
+	mode_geometry (mode_info, output->rotation,
+		       &output->transform.transform,
+		       &bounds);
+	/*
+	 * The server wants the whole transformed size to the right of and
+	 * below the crtc position, even when the transform (a keystone
+	 * correction say) reaches further left or up
+	 */
+	x = output->x + (bounds.x1 > 0 ? bounds.x1 : 0);
+	y = output->y + (bounds.y1 > 0 ? bounds.y1 : 0);
+	w = bounds.x2 - bounds.x1;
+	h = bounds.y2 - bounds.y1;
+	/*
+	 * find the size needed for the output and its panning area; a
+	 * specified size smaller than that is refused by preflight()
+	 */
+	if (x + w > need_width)
+	    need_width = x + w;
+	if (y + h > need_height)
+	    need_height = y + h;
+	if (output->changes & changes_panning)
+	    pan = &output->panning;
+	else
+	    pan = output->crtc_info ? output->crtc_info->panning_info : NULL;
+	if (pan && (int) (pan->left + pan->width) > need_width)
+	    need_width = pan->left + pan->width;
+	if (pan && (int) (pan->top + pan->height) > need_height)
+	    need_height = pan->top + pan->height;
+    }	
+    if (need_width < minWidth) need_width = minWidth;
+    if (need_height < minHeight) need_height = minHeight;
+
+    /* fit fb to outputs */
+    if (!fb_specified)
+    {
+	fb_width = need_width;
+	fb_height = need_height;
+    }
+
+    /*
+     * A specified screen larger than needed may be shrunk to stay
+     * within the memory budget; anything else over it is refused
+     */
+    if (max_fb_bytes && fb_bytes (fb_width, fb_height) > max_fb_bytes)
+    {
+	if (fb_specified && fb_bytes (need_width, need_height) <= max_fb_bytes)
+	{
+	    warning ("shrinking screen from %dx%d to %dx%d to stay within %.1f MiB\n",
+		     fb_width, fb_height, need_width, need_height,
+		     max_fb_bytes / (1024 * 1024));
+	    fb_width = need_width;
+	    fb_height = need_height;
+	}
+	else
+	    fatal ("screen %dx%d needs %.1f MiB, more than the %.1f MiB allowed\n",
+		   fb_width, fb_height,
+		   fb_bytes (fb_width, fb_height) / (1024 * 1024),
+		   max_fb_bytes / (1024 * 1024));
+    }
+
+    if (fb_width > maxWidth || fb_height > maxHeight)
+        fatal ("screen cannot be larger than %dx%d (desired size %dx%d)\n",
+	       maxWidth, maxHeight, fb_width, fb_height);
+    if (fb_specified)
+    {
+	if (fb_width < minWidth || fb_height < minHeight)
+	    fatal ("screen must be at least %dx%d\n", minWidth, minHeight);
+    }
+
+    if (verbose)
+	printf ("screen %d: %dx%d framebuffer, about %.1f MiB\n", screen,
+		fb_width, fb_height, fb_bytes (fb_width, fb_height) / (1024 * 1024));
+}
+    
+
+static void
+disable_outputs (output_t *outputs)
+{
+    while (outputs)
+    {
+	outputs->crtc_info = NULL;
+	outputs = outputs->next;
+    }
+}
+
+/*
+ * find the best mapping from output to crtc available
+ */
+static int
+pick_crtcs_score (output_t *outputs)
+{
+    output_t	*output;
+    int		best_score;
+    int		my_score;
+    int		score;
+    crtc_t	*best_crtc;
+    int		c;
+    
+    if (!outputs)
+	return 0;
+    
+    output = outputs;
+    outputs = outputs->next;
+    /*
+     * Score with this output disabled
+     */
+    output->crtc_info = NULL;
+    best_score = pick_crtcs_score (outputs);
+    if (output->mode_info == NULL)
+	return best_score;
+
+    best_crtc = NULL;
+    /* 
+     * Now score with this output any valid crtc
+     */
+    for (c = 0; c < output->output_info->ncrtc; c++)
+    {
+	crtc_t	    *crtc;
+
+	crtc = find_crtc_by_xid (output->output_info->crtcs[c]);
+	if (!crtc)
+	    fatal ("cannot find crtc 0x%x\n", output->output_info->crtcs[c]);
+	
+	/* reset crtc allocation for following outputs */
+	disable_outputs (outputs);
+	if (!check_crtc_for_output (crtc, output))
+	    continue;
+	
+	my_score = 1000;
+	/* slight preference for existing connections */
+	if (crtc == output->current_crtc_info)
+	    my_score++;
+
+	output->crtc_info = crtc;
+	score = my_score + pick_crtcs_score (outputs);
+	if (score > best_score)
+	{
+	    best_crtc = crtc;
+	    best_score = score;
+	}
+    }
+    if (output->crtc_info != best_crtc)
+	output->crtc_info = best_crtc;
+    /*
+     * Reset other outputs based on this one using the best crtc
+     */
+    (void) pick_crtcs_score (outputs);
+
+    return best_score;
+}
+
+/*
+ * Pick crtcs for any changing outputs that don't have one
+ */
+static void
+pick_crtcs (void)
+{
+    output_t	*output;
+
+    /*
+     * First try to match up newly enabled outputs with spare crtcs
+     */
+    for (output = outputs; output; output = output->next)
+    {
+	if (output->changes && output->mode_info)
+	{
+	    if (output->crtc_info) {
+		if (output->crtc_info->crtc_info->noutput > 0 &&
+		    (output->crtc_info->crtc_info->noutput > 1 ||
+		     output != find_output_by_xid (output->crtc_info->crtc_info->outputs[0])))
+		    break;
+	    } else {
+		output->crtc_info = find_crtc_for_output (output);
+		if (!output->crtc_info)
+		    break;
+	    }
+	}
+    }
+    /*
+     * Everyone is happy
+     */
+    if (!output)
+	return;
+    /*
+     * When the simple way fails, see if there is a way
+     * to swap crtcs around and make things work
+     */
+    for (output = outputs; output; output = output->next)
+	output->current_crtc_info = output->crtc_info;
+    pick_crtcs_score (outputs);
+    for (output = outputs; output; output = output->next)
+    {
+	if (output->mode_info && !output->crtc_info)
+	    fatal ("cannot find crtc for output %s\n", output->output.string);
+	if (!output->changes && output->crtc_info != output->current_crtc_info)
+	    output->changes |= changes_crtc;
+    }
+}
+
+static int
+check_strtol(char *s)
+{
+    char *endptr;
+    int result = strtol(s, &endptr, 10);
+    if (s == endptr)
+	usage();
+    return result;
+}
+
+static double
+check_strtod(char *s)
+{
+    char *endptr;
+    double result = strtod(s, &endptr);
+    if (s == endptr)
+	usage();
+    return result;
+}
+
+
+static void *
+property_values_from_string(const char *str, const Atom type, const int format,
+                            int *returned_nitems)
+{
+    char *token, *tmp;
+    void *returned_bytes = NULL;
+    int nitems = 0, bytes_per_item = format / 8;
+
+    if ((type != XA_INTEGER && type != XA_CARDINAL) ||
+	(format != 8 && format != 16 && format != 32))
+    {
+	return NULL;
+    }
+
+    tmp = strdup (str);
+
+    for (token = strtok (tmp, ","); token; token = strtok (NULL, ","))
+    {
+	char *endptr;
+	long int val = strtol (token, &endptr, 0);
+
+	if (token == endptr || *endptr != '\0')
+	{
+	    usage ();
+	}
+
+	returned_bytes = realloc (returned_bytes, (nitems + 1) * bytes_per_item);
+
+	if (type == XA_INTEGER && format == 8)
+	{
+	    int8_t *ptr = returned_bytes;
+	    ptr[nitems] = (int8_t) val;
+	}
+	else if (type == XA_INTEGER && format == 16)
+	{
+	    int16_t *ptr = returned_bytes;
+	    ptr[nitems] = (int16_t) val;
+	}
+	else if (type == XA_INTEGER && format == 32)
+	{
+	    int32_t *ptr = returned_bytes;
+	    ptr[nitems] = (int32_t) val;
+	}
+	else if (type == XA_CARDINAL && format == 8)
+	{
+	    uint8_t *ptr = returned_bytes;
+	    ptr[nitems] = (uint8_t) val;
+	}
+	else if (type == XA_CARDINAL && format == 16)
+	{
+	    uint16_t *ptr = returned_bytes;
+	    ptr[nitems] = (uint16_t) val;
+	}
+	else if (type == XA_CARDINAL && format == 32)
+	{
+	    uint32_t *ptr = returned_bytes;
+	    ptr[nitems] = (uint32_t) val;
+	}
+	else
+	{
+	    free (tmp);
+	    free (returned_bytes);
+	    return NULL;
+	}
+
+	nitems++;
+    }
+
+    free (tmp);
+
+    *returned_nitems = nitems;
+    return returned_bytes;
+}
+
+
+static void
+print_output_property_value(Bool is_edid,
+                            int value_format, /* 8, 16, 32 */
+                            Atom value_type,  /* XA_{ATOM,INTEGER,CARDINAL} */
+                            const void *value_bytes)
+{
+    /* special-case the EDID */
+    if (is_edid && value_format == 8)
+    {
+	const uint8_t *val = value_bytes;
+	printf ("%02" PRIx8, *val);
+	return;
+    }
+
+    if (value_type == XA_ATOM && value_format == 32)
+    {
+	const Atom *val = value_bytes;
+	char *str = XGetAtomName (dpy, *val);
+	if (str != NULL)
+	{
+	    printf ("%s", str);
+	    XFree (str);
+	    return;
+	}
+    }
+
+    if (value_type == XA_INTEGER)
+    {
+	if (value_format == 8)
+	{
+	    const int8_t *val = value_bytes;
+	    printf ("%" PRId8, *val);
+	    return;
+	}
+	if (value_format == 16)
+	{
+	    const int16_t *val = value_bytes;
+	    printf ("%" PRId16, *val);
+	    return;
+	}
+	if (value_format == 32)
+	{
+	    const int32_t *val = value_bytes;
+	    printf ("%" PRId32, *val);
+	    return;
+	}
+    }
+
+    if (value_type == XA_CARDINAL)
+    {
+	if (value_format == 8)
+	{
+	    const uint8_t *val = value_bytes;
+	    printf ("%" PRIu8, *val);
+	    return;
+	}
+	if (value_format == 16)
+	{
+	    const uint16_t *val = value_bytes;
+	    printf ("%" PRIu16, *val);
+	    return;
+	}
+	if (value_format == 32)
+	{
+	    const uint32_t *val = value_bytes;
+	    printf ("%" PRIu32, *val);
+	    return;
+	}
+    }
+
+    printf ("?");
+}
+
+
+
+/*
+ * Write the state read by get_screen(), get_crtcs() and get_outputs()
+ * in the format read_snapshot() understands
+ */
+static void
+write_snapshot (char *file, int major, int minor)
+{
+    FILE    *f = strcmp (file, "-") ? fopen (file, "w") : stdout;
+    int	    bpp, pad;
+    int	    c, o, m, j;
+
+    if (!f)
+	fatal ("cannot create snapshot %s\n", file);
+    pixmap_format (&bpp, &pad);
+    fprintf (f, "# xrandr snapshot\n");
+    fprintf (f, "version %d %d\n", major, minor);
+    fprintf (f, "screen %d %d %d %d\n", screen_width, screen_height,
+	     screen_width_mm, screen_height_mm);
+    fprintf (f, "limits %d %d %d %d\n", minWidth, minHeight,
+	     maxWidth, maxHeight);
+    fprintf (f, "pixmap %d %d\n", bpp, pad);
+    fprintf (f, "timestamp %lu %lu\n", res->timestamp, res->configTimestamp);
+    for (m = 0; m < res->nmode; m++)
+    {
+	XRRModeInfo *mode = &res->modes[m];
+
+	fprintf (f, "mode 0x%lx %u %u %lu %u %u %u %u %u %u %u 0x%lx %s\n",
+		 mode->id, mode->width, mode->height, mode->dotClock,
+		 mode->hSyncStart, mode->hSyncEnd, mode->hTotal, mode->hSkew,
+		 mode->vSyncStart, mode->vSyncEnd, mode->vTotal,
+		 mode->modeFlags, mode->name);
+    }
+    for (c = 0; c < num_crtcs; c++)
+    {
+	crtc_t	    *crtc = &crtcs[c];
+	XRRCrtcInfo *info = crtc->crtc_info;
+	XRRPanning  *pan = crtc->panning_info;
+	XTransform  *t = &crtc->current_transform.transform;
+
+	fprintf (f, "crtc 0x%lx %d %d %u %u 0x%lx %u %u %d\n",
+		 crtc->crtc.xid, info->x, info->y, info->width, info->height,
+		 info->mode, info->rotation, info->rotations,
+		 crtc_gamma_size (crtc));
+	fprintf (f, "crtc-outputs 0x%lx", crtc->crtc.xid);
+	for (j = 0; j < info->noutput; j++)
+	    fprintf (f, " 0x%lx", info->outputs[j]);
+	fprintf (f, "\ncrtc-possible 0x%lx", crtc->crtc.xid);
+	for (j = 0; j < info->npossible; j++)
+	    fprintf (f, " 0x%lx", info->possible[j]);
+	fprintf (f, "\n");
+	if (pan)
+	    fprintf (f, "crtc-panning 0x%lx %u %u %u %u %u %u %u %u %d %d %d %d\n",
+		     crtc->crtc.xid, pan->left, pan->top, pan->width, pan->height,
+		     pan->track_left, pan->track_top,
+		     pan->track_width, pan->track_height,
+		     pan->border_left, pan->border_top,
+		     pan->border_right, pan->border_bottom);
+	if (!transform_is_identity (t) || *crtc->current_transform.filter)
+	    fprintf (f, "crtc-transform 0x%lx %d %d %d %d %d %d %d %d %d %s\n",
+		     crtc->crtc.xid,
+		     t->matrix[0][0], t->matrix[0][1], t->matrix[0][2],
+		     t->matrix[1][0], t->matrix[1][1], t->matrix[1][2],
+		     t->matrix[2][0], t->matrix[2][1], t->matrix[2][2],
+		     crtc->current_transform.filter);
+    }
+    for (o = 0; o < res->noutput; o++)
+    {
+	output_t	*output = find_output_by_xid (res->outputs[o]);
+	XRROutputInfo	*info;
+	tile_t		tile;
+	char		*path;
+
+	if (!output || !output->output_info)
+	    continue;
+	info = output->output_info;
+	fprintf (f, "output 0x%lx %u %lu %lu %u 0x%lx %d %s\n",
+		 res->outputs[o], info->connection,
+		 info->mm_width, info->mm_height, info->subpixel_order,
+		 info->crtc, info->npreferred, info->name);
+	fprintf (f, "output-crtcs 0x%lx", res->outputs[o]);
+	for (j = 0; j < info->ncrtc; j++)
+	    fprintf (f, " 0x%lx", info->crtcs[j]);
+	fprintf (f, "\noutput-clones 0x%lx", res->outputs[o]);
+	for (j = 0; j < info->nclone; j++)
+	    fprintf (f, " 0x%lx", info->clones[j]);
+	fprintf (f, "\noutput-modes 0x%lx", res->outputs[o]);
+	for (j = 0; j < info->nmode; j++)
+	    fprintf (f, " 0x%lx", info->modes[j]);
+	fprintf (f, "\n");
+	if (output_tile (res->outputs[o], &tile))
+	    fprintf (f, "output-tile 0x%lx %d %d %d %d %d %d %d %d\n",
+		     res->outputs[o], tile.group, tile.flags,
+		     tile.num_h, tile.num_v, tile.h_loc, tile.v_loc,
+		     tile.width, tile.height);
+	fprintf (f, "output-bpc 0x%lx %d\n", res->outputs[o],
+		 output_bpc (output));
+	if ((path = output_string_property (output, "PATH")))
+	    fprintf (f, "output-path 0x%lx %s\n", res->outputs[o], path);
+    }
+    if (has_1_3 && get_output_primary ())
+	fprintf (f, "primary 0x%lx\n", get_output_primary ());
+    if (f != stdout)
+	fclose (f);
+}
+
+static void
+write_plan_transform (FILE *f, crtc_t *crtc, transform_t *transform)
+{
+    XTransform	*t = &transform->transform;
+    int		p;
+
+    if (transform_is_identity (t) && !*transform->filter)
+	return;
+    fprintf (f, "transform 0x%lx %d %d %d %d %d %d %d %d %d %s",
+	     crtc->crtc.xid,
+	     t->matrix[0][0], t->matrix[0][1], t->matrix[0][2],
+	     t->matrix[1][0], t->matrix[1][1], t->matrix[1][2],
+	     t->matrix[2][0], t->matrix[2][1], t->matrix[2][2],
+	     *transform->filter ? transform->filter : "-");
+    for (p = 0; p < transform->nparams; p++)
+	fprintf (f, " %d", transform->params[p]);
+    fprintf (f, "\n");
+}
+
+/*
+ * A gamma ramp goes in lines of up to PLAN_RAMP_LINE entries: the
+ * red, green and blue channels one after the other, in hex, starting
+ * at the given index
+ */
+#define PLAN_RAMP_LINE	256
+
+static void
+write_plan_ramp (FILE *f, crtc_t *crtc, XRRCrtcGamma *gamma)
+{
+    unsigned short  *channels[3];
+    int		    i;
+
+    channels[0] = gamma->red;
+    channels[1] = gamma->green;
+    channels[2] = gamma->blue;
+    for (i = 0; i < 3 * gamma->size; i++)
+    {
+	if (i % PLAN_RAMP_LINE == 0)
+	    fprintf (f, "ramp 0x%lx %d %d", crtc->crtc.xid, gamma->size, i);
+	fprintf (f, " %x", channels[i / gamma->size][i % gamma->size]);
+	if (i % PLAN_RAMP_LINE == PLAN_RAMP_LINE - 1 || i == 3 * gamma->size - 1)
+	    fprintf (f, "\n");
+    }
+}
+
+static void
+write_plan_panning (FILE *f, crtc_t *crtc, XRRPanning *pan)
+{
+    fprintf (f, "panning 0x%lx %u %u %u %u %u %u %u %u %d %d %d %d\n",
+	     crtc->crtc.xid, pan->left, pan->top, pan->width, pan->height,
+	     pan->track_left, pan->track_top,
+	     pan->track_width, pan->track_height,
+	     pan->border_left, pan->border_top,
+	     pan->border_right, pan->border_bottom);
+}
+
+/*
+ * A plan is the outcome of planning: the screen size and the complete
+ * target state of every crtc, plus gamma and primary changes, tied to
+ * the configuration it was computed against:
+ *
+ *	config-timestamp timestamp
+ *	screen width height width_mm height_mm
+ *	output id name
+ *	crtc id off
+ *	crtc id mode x y rotation output...
+ *	transform crtc m00 m01 m02 m10 m11 m12 m20 m21 m22 filter param...
+ *	panning crtc left top width height track_left track_top
+ *		track_width track_height border_left border_top
+ *		border_right border_bottom
+ *	gamma output crtc red green blue brightness [color_temp]
+ *	primary output
+ *	noprimary
+ */
+static void
+write_plan (char *file)
+{
+    FILE	*f = strcmp (file, "-") ? fopen (file, "w") : stdout;
+    output_t	*output;
+    int		c, o;
+
+    if (!f)
+	fatal ("cannot create plan %s\n", file);
+    fprintf (f, "# xrandr plan\n");
+    fprintf (f, "config-timestamp %lu\n", res->configTimestamp);
+    fprintf (f, "screen %d %d %d %d\n", fb_width, fb_height,
+	     fb_width_mm, fb_height_mm);
+    for (output = outputs; output; output = output->next)
+	if (output->mode_info ||
+	    (output->changes & (changes_gamma|changes_primary)))
+	    fprintf (f, "output 0x%lx %s\n", output->output.xid,
+		     output->output.string);
+    for (c = 0; c < num_crtcs; c++)
+    {
+	crtc_t	    *crtc = &crtcs[c];
+
+	if (!crtc->mode_info)
+	{
+	    fprintf (f, "crtc 0x%lx off\n", crtc->crtc.xid);
+	    continue;
+	}
+	fprintf (f, "crtc 0x%lx 0x%lx %d %d %u", crtc->crtc.xid,
+		 crtc->mode_info->id, crtc->x, crtc->y, crtc->rotation);
+	for (o = 0; o < crtc->noutput; o++)
+	    fprintf (f, " 0x%lx", crtc->outputs[o]->output.xid);
+	fprintf (f, "\n");
+	write_plan_transform (f, crtc, &crtc->pending_transform);
+	if (crtc->panning_info)
+	    write_plan_panning (f, crtc, crtc->panning_info);
+    }
+    for (output = outputs; output; output = output->next)
+    {
+	if ((output->changes & changes_gamma) && output->crtc_info)
+	{
+	    fprintf (f, "gamma 0x%lx 0x%lx %g %g %g %g",
+		     output->output.xid, output->crtc_info->crtc.xid,
+		     output->gamma.red, output->gamma.green,
+		     output->gamma.blue, output->brightness);
+	    if (output->color_temp)
+		fprintf (f, " %g", output->color_temp);
+	    fprintf (f, "\n");
+	}
+	if ((output->changes & changes_primary) && output->primary)
+	    fprintf (f, "primary 0x%lx\n", output->output.xid);
+    }
+    if (no_primary)
+	fprintf (f, "noprimary\n");
+    if (f != stdout)
+	fclose (f);
+}
+
+/*
+ * Load a plan written by --plan-out into the crtcs read by get_crtcs(),
+ * refusing it when the outputs changed since it was made. Only crtcs
+ * whose state differs from the plan are marked changing
+ */
+static void
+read_plan (char *file, Bool check_timestamp)
+{
+    FILE	*f = fopen (file, "r");
+    char	line[8192];
+    int		lineno = 0;
+    int		c;
+    XRRPanning	**pannings;
+
+    if (!f)
+	fatal ("cannot open plan %s\n", file);
+    pannings = calloc (num_crtcs, sizeof (XRRPanning *));
+    if (!pannings) fatal ("out of memory\n");
+    for (c = 0; c < num_crtcs; c++)
+    {
+	crtcs[c].mode_info = find_mode_by_xid (crtcs[c].crtc_info->mode);
+	init_transform (&crtcs[c].pending_transform);
+    }
+    while (fgets (line, sizeof (line), f))
+    {
+	char	    key[32];
+	char	    *rest;
+	XID	    id, xid;
+	Time	    timestamp;
+	crtc_t	    *crtc = NULL;
+	output_t    *output;
+	int	    n, m, ok;
+
+	lineno++;
+	line[strcspn (line, "\n")] = '\0';
+	if (sscanf (line, "%31s %n", key, &n) != 1 || key[0] == '#')
+	    continue;
+	rest = line + n;
+	if (strcmp (key, "config-timestamp") && strcmp (key, "screen") &&
+	    strcmp (key, "noprimary"))
+	{
+	    if (sscanf (rest, "%lx %n", &id, &m) != 1)
+		fatal ("%s:%d: invalid plan line\n", file, lineno);
+	    rest += m;
+	    if (strcmp (key, "output") && strcmp (key, "gamma") &&
+		strcmp (key, "primary") && !(crtc = find_crtc_by_xid (id)))
+		fatal ("plan %s refers to unknown crtc 0x%lx\n", file, id);
+	}
+	if (!strcmp (key, "config-timestamp"))
+	{
+	    ok = sscanf (rest, "%lu", &timestamp) == 1;
+	    if (ok && check_timestamp && timestamp != res->configTimestamp)
+		fatal ("plan %s is stale: the outputs changed since it was made\n", file);
+	}
+	else if (!strcmp (key, "screen"))
+	    ok = sscanf (rest, "%d %d %d %d", &fb_width, &fb_height,
+			 &fb_width_mm, &fb_height_mm) == 4 &&
+		 fb_width >= minWidth && fb_width <= maxWidth &&
+		 fb_height >= minHeight && fb_height <= maxHeight &&
+		 fb_height_mm > 0;
+	else if (!strcmp (key, "output"))
+	{
+	    for (n = 0; n < res->noutput; n++)
+		if (res->outputs[n] == id)
+		    break;
+	    if (n == res->noutput)
+		fatal ("plan %s refers to unknown output 0x%lx\n", file, id);
+	    output = add_output ();
+	    set_name_xid (&output->output, id);
+	    set_name_index (&output->output, n);
+	    set_name_string (&output->output, strdup (rest));
+	    ok = True;
+	}
+	else if (!strcmp (key, "crtc"))
+	{
+	    XID	*xids;
+	    int	nxid;
+
+	    crtc->mode_info = NULL;
+	    crtc->noutput = 0;
+	    if (!strcmp (rest, "off"))
+		ok = True;
+	    else if ((ok = sscanf (rest, "%lx %d %d %hu %n", &xid, &crtc->x,
+				   &crtc->y, &crtc->rotation, &m) == 4))
+	    {
+		if (!(crtc->mode_info = find_mode_by_xid (xid)))
+		    fatal ("plan %s refers to unknown mode 0x%lx\n", file, xid);
+		nxid = read_xids (rest + m, &xids);
+		ok = nxid > 0;
+		crtc->outputs = realloc (crtc->outputs, (nxid > 0 ? nxid : 1) * sizeof (output_t *));
+		if (!crtc->outputs) fatal ("out of memory\n");
+		for (n = 0; n < nxid; n++)
+		{
+		    if (!(output = find_output_by_xid (xids[n])))
+			fatal ("plan %s refers to unlisted output 0x%lx\n", file, xids[n]);
+		    crtc->outputs[crtc->noutput++] = output;
+		}
+		free (xids);
+	    }
+	}
+	else if (!strcmp (key, "transform"))
+	{
+	    XTransform	t;
+	    char	filter[64];
+	    XFixed	*fixed = NULL;
+	    int		nparam;
+
+	    ok = sscanf (rest, "%d %d %d %d %d %d %d %d %d %63s %n",
+			 &t.matrix[0][0], &t.matrix[0][1], &t.matrix[0][2],
+			 &t.matrix[1][0], &t.matrix[1][1], &t.matrix[1][2],
+			 &t.matrix[2][0], &t.matrix[2][1], &t.matrix[2][2],
+			 filter, &m) == 10;
+	    if (ok)
+	    {
+		/* filter parameters are small fixed point numbers */
+		nparam = 0;
+		for (rest += m; *rest; nparam++)
+		{
+		    fixed = realloc (fixed, (nparam + 1) * sizeof (XFixed));
+		    if (!fixed) fatal ("out of memory\n");
+		    fixed[nparam] = strtol (rest, &rest, 10);
+		    while (*rest == ' ')
+			rest++;
+		}
+		set_transform (&crtc->pending_transform, &t,
+			       strcmp (filter, "-") ? filter : "",
+			       fixed, nparam);
+		free (fixed);
+	    }
+	}
+	else if (!strcmp (key, "panning"))
+	{
+	    XRRPanning	*p = calloc (1, sizeof (XRRPanning));
+
+	    if (!p) fatal ("out of memory\n");
+	    ok = sscanf (rest, "%u %u %u %u %u %u %u %u %d %d %d %d",
+			 &p->left, &p->top, &p->width, &p->height,
+			 &p->track_left, &p->track_top,
+			 &p->track_width, &p->track_height,
+			 &p->border_left, &p->border_top,
+			 &p->border_right, &p->border_bottom) == 12;
+	    pannings[crtc - crtcs] = p;
+	}
+	else if (!strcmp (key, "ramp"))
+	{
+	    unsigned short  *channels[3];
+	    unsigned long   v;
+	    char	    *end;
+	    int		    size, i;
+
+	    ok = sscanf (rest, "%d %d %n", &size, &i, &m) == 2 &&
+		 size > 0 && size <= 65536 && i >= 0;
+	    if (ok && !crtc->plan_gamma &&
+		!(crtc->plan_gamma = XRRAllocGamma (size)))
+		fatal ("out of memory\n");
+	    if (ok)
+	    {
+		ok = crtc->plan_gamma->size == size;
+		channels[0] = crtc->plan_gamma->red;
+		channels[1] = crtc->plan_gamma->green;
+		channels[2] = crtc->plan_gamma->blue;
+		for (rest += m; ok && *rest; i++)
+		{
+		    v = strtoul (rest, &end, 16);
+		    ok = end != rest && v <= 0xffff && i < 3 * size;
+		    if (ok)
+			channels[i / size][i % size] = v;
+		    for (rest = end; *rest == ' '; rest++)
+			;
+		}
+	    }
+	}
+	else if (!strcmp (key, "gamma"))
+	{
+	    if (!(output = find_output_by_xid (id)))
+		fatal ("plan %s refers to unlisted output 0x%lx\n", file, id);
+	    n = sscanf (rest, "%lx %f %f %f %f %f", &xid,
+			&output->gamma.red, &output->gamma.green,
+			&output->gamma.blue, &output->brightness,
+			&output->color_temp);
+	    ok = n == 5 || n == 6;
+	    output->brightness_set = True;
+	    if (ok && !(output->crtc_info = find_crtc_by_xid (xid)))
+		fatal ("plan %s refers to unknown crtc 0x%lx\n", file, xid);
+	    output->changes |= changes_gamma;
+	}
+	else if (!strcmp (key, "primary"))
+	{
+	    if (!(output = find_output_by_xid (id)))
+		fatal ("plan %s refers to unlisted output 0x%lx\n", file, id);
+	    output->primary = True;
+	    output->changes |= changes_primary;
+	    ok = True;
+	}
+	else if (!strcmp (key, "noprimary"))
+	{
+	    no_primary = True;
+	    ok = True;
+	}
+	else
+	    ok = False;
+	if (!ok)
+	    fatal ("%s:%d: invalid plan line\n", file, lineno);
+    }
+    fclose (f);
+    if (!fb_width)
+	fatal ("%s: incomplete plan\n", file);
+    dpi = (25.4 * fb_height) / fb_height_mm;
+
+    /* crtcs without a panning line keep theirs */
+    for (c = 0; c < num_crtcs; c++)
+    {
+	crtc_t	    *crtc = &crtcs[c];
+
+	crtc->panning_info = pannings[c] ? pannings[c] : crtc->current_panning;
+	crtc->changing = crtc_plan_changes (crtc);
+    }
+    free (pannings);
+}
+
+/*
+ * Plans are cached in $XDG_RUNTIME_DIR/xrandr, named by an FNV-1a hash
+ * of the arguments and of everything the planner reads: screen limits
+ * and size, modes, the current crtc state and the outputs, including
+ * their EDID. Any difference in any of them leads to another file, so
+ * stale entries are never used; they age out, as only the
+ * PLAN_CACHE_ENTRIES most recently used plans are kept.
+ */
+#define PLAN_CACHE_ENTRIES  64
+
+#define FNV_OFFSET  0xcbf29ce484222325ULL
+#define FNV_PRIME   0x100000001b3ULL
+
+static uint64_t
+fnv1a (uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char	*p = data;
+
+    while (len--)
+    {
+	hash ^= *p++;
+	hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint64_t
+fnv1a_long (uint64_t hash, long value)
+{
+    return fnv1a (hash, &value, sizeof (value));
+}
+
+static uint64_t
+fnv1a_string (uint64_t hash, const char *string)
+{
+    return fnv1a (hash, string, strlen (string) + 1);
+}
+
+static uint64_t
+fnv1a_edid (uint64_t hash, RROutput output)
+{
+    Atom	    name = XInternAtom (dpy, "EDID", True);
+    Atom	    actual_type;
+    int		    actual_format;
+    unsigned long   nitems, bytes_after;
+    unsigned char   *prop;
+
+    if (name == None)
+	return hash;
+    if (XRRGetOutputProperty (dpy, output, name, 0, 256,
+			      False, False, AnyPropertyType,
+			      &actual_type, &actual_format,
+			      &nitems, &bytes_after, &prop) != Success)
+	return hash;
+    if (actual_format == 8)
+	hash = fnv1a (hash, prop, nitems);
+    XFree (prop);
+    return hash;
+}
+
+static char *
+runtime_dir (void)
 {
-    while (outputs)
-    {
-	outputs->crtc_info = NULL;
-	outputs = outputs->next;
-    }
+    char	*runtime = getenv ("XDG_RUNTIME_DIR");
+    char	*dir;
+
+    if (!runtime || !*runtime)
+	return NULL;
+    dir = malloc (strlen (runtime) + sizeof ("/xrandr"));
+    if (!dir) fatal ("out of memory\n");
+    sprintf (dir, "%s/xrandr", runtime);
+    mkdir (dir, 0700);
+    return dir;
 }
 
 /*
- * find the best mapping from output to crtc available
+ * Name of the cache entry for this invocation, NULL when there is
+ * nowhere to keep it. Needs get_screen() and get_crtcs()
  */
-static int
-pick_crtcs_score (output_t *outputs)
+static char *
+plan_cache_file (int argc, char **argv)
 {
-    output_t	*output;
-    int		best_score;
-    int		my_score;
-    int		score;
-    crtc_t	*best_crtc;
-    int		c;
-    
-    if (!outputs)
-	return 0;
-    
-    output = outputs;
-    outputs = outputs->next;
-    /*
-     * Score with this output disabled
-     */
-    output->crtc_info = NULL;
-    best_score = pick_crtcs_score (outputs);
-    if (output->mode_info == NULL)
-	return best_score;
+    char	*dir = runtime_dir ();
+    char	*file;
+    uint64_t	hash = FNV_OFFSET;
+    budget_t	*budget;
+    int		i, j;
 
-    best_crtc = NULL;
-    /* 
-     * Now score with this output any valid crtc
-     */
-    for (c = 0; c < output->output_info->ncrtc; c++)
-    {
-	crtc_t	    *crtc;
+    if (!dir)
+	return NULL;
 
-	crtc = find_crtc_by_xid (output->output_info->crtcs[c]);
-	if (!crtc)
-	    fatal ("cannot find crtc 0x%x\n", output->output_info->crtcs[c]);
-	
-	/* reset crtc allocation for following outputs */
-	disable_outputs (outputs);
-	if (!check_crtc_for_output (crtc, output))
+    /* arguments, leaving out those which don't change the plan */
+    for (i = 1; i < argc; i++)
+    {
+	if (!strcmp (argv[i], "--verbose") || !strcmp (argv[i], "--dryrun") ||
+	    !strcmp (argv[i], "--plan-cache") ||
+	    !strncmp (argv[i], "--wait-settle", 13))
 	    continue;
-	
-	my_score = 1000;
-	/* slight preference for existing connections */
-	if (crtc == output->current_crtc_info)
-	    my_score++;
-
-	output->crtc_info = crtc;
-	score = my_score + pick_crtcs_score (outputs);
-	if (score > best_score)
+	if (!strcmp (argv[i], "--plan-out"))
 	{
-	    best_crtc = crtc;
-	    best_score = score;
+	    i++;
+	    continue;
 	}
+	hash = fnv1a_string (hash, strcmp (argv[i], "--refresh") ? argv[i] : "--rate");
+    }
+    for (budget = budgets; budget; budget = budget->next)
+    {
+	hash = fnv1a_long (hash, budget->kind);
+	hash = fnv1a (hash, &budget->limit, sizeof (budget->limit));
+	hash = fnv1a_string (hash, budget->name ? budget->name : "");
+	for (j = 0; j < budget->noutput; j++)
+	    hash = fnv1a_string (hash, budget->outputs[j]);
     }
-    if (output->crtc_info != best_crtc)
-	output->crtc_info = best_crtc;
-    /*
-     * Reset other outputs based on this one using the best crtc
-     */
-    (void) pick_crtcs_score (outputs);
 
-    return best_score;
+    hash = fnv1a_long (hash, screen_width);
+    hash = fnv1a_long (hash, screen_height);
+    hash = fnv1a_long (hash, screen_width_mm);
+    hash = fnv1a_long (hash, screen_height_mm);
+    hash = fnv1a_long (hash, minWidth);
+    hash = fnv1a_long (hash, minHeight);
+    hash = fnv1a_long (hash, maxWidth);
+    hash = fnv1a_long (hash, maxHeight);
+
+    for (i = 0; i < res->nmode; i++)
+    {
+	XRRModeInfo *mode = &res->modes[i];
+
+	hash = fnv1a_long (hash, mode->id);
+	hash = fnv1a_long (hash, mode->width);
+	hash = fnv1a_long (hash, mode->height);
+	hash = fnv1a_long (hash, mode->dotClock);
+	hash = fnv1a_long (hash, mode->hSyncStart);
+	hash = fnv1a_long (hash, mode->hSyncEnd);
+	hash = fnv1a_long (hash, mode->hTotal);
+	hash = fnv1a_long (hash, mode->vSyncStart);
+	hash = fnv1a_long (hash, mode->vSyncEnd);
+	hash = fnv1a_long (hash, mode->vTotal);
+	hash = fnv1a_long (hash, mode->modeFlags);
+	hash = fnv1a_string (hash, mode->name);
+    }
+
+    for (i = 0; i < num_crtcs; i++)
+    {
+	crtc_t	    *crtc = &crtcs[i];
+	XRRCrtcInfo *crtc_info = crtc->crtc_info;
+	XRRPanning  *pan = crtc->panning_info;
+
+	hash = fnv1a_long (hash, crtc->crtc.xid);
+	hash = fnv1a_long (hash, crtc_info->mode);
+	hash = fnv1a_long (hash, crtc_info->x);
+	hash = fnv1a_long (hash, crtc_info->y);
+	hash = fnv1a_long (hash, crtc_info->rotation);
+	for (j = 0; j < crtc_info->noutput; j++)
+	    hash = fnv1a_long (hash, crtc_info->outputs[j]);
+	hash = fnv1a (hash, &crtc->current_transform.transform,
+		      sizeof (XTransform));
+	hash = fnv1a_string (hash, crtc->current_transform.filter);
+	if (pan)
+	    hash = fnv1a (hash, &pan->left,
+			  sizeof (XRRPanning) - offsetof (XRRPanning, left));
+    }
+
+    for (i = 0; i < res->noutput; i++)
+    {
+	XRROutputInfo	*output_info = get_output_info (res->outputs[i]);
+
+	if (!output_info) fatal ("could not get output 0x%x information\n", res->outputs[i]);
+	hash = fnv1a_long (hash, res->outputs[i]);
+	hash = fnv1a_string (hash, output_info->name);
+	hash = fnv1a_long (hash, output_info->connection);
+	hash = fnv1a_long (hash, output_info->mm_width);
+	hash = fnv1a_long (hash, output_info->mm_height);
+	hash = fnv1a_long (hash, output_info->npreferred);
+	for (j = 0; j < output_info->nmode; j++)
+	    hash = fnv1a_long (hash, output_info->modes[j]);
+	for (j = 0; j < output_info->ncrtc; j++)
+	    hash = fnv1a_long (hash, output_info->crtcs[j]);
+	for (j = 0; j < output_info->nclone; j++)
+	    hash = fnv1a_long (hash, output_info->clones[j]);
+	hash = fnv1a_edid (hash, res->outputs[i]);
+	XRRFreeOutputInfo (output_info);
+    }
+    if (has_1_3)
+	hash = fnv1a_long (hash, get_output_primary ());
+
+    file = malloc (strlen (dir) + sizeof ("/plan-") + 16);
+    if (!file) fatal ("out of memory\n");
+    sprintf (file, "%s/plan-%016" PRIx64, dir, hash);
+    free (dir);
+    return file;
 }
 
 /*
- * Pick crtcs for any changing outputs that don't have one
+ * Drop the least recently used plans until there is room for one
+ * more; a hit touches its plan
  */
 static void
-pick_crtcs (void)
+plan_cache_evict (void)
 {
-    output_t	*output;
-
-    /*
-     * First try to match up newly enabled outputs with spare crtcs
-     */
-    for (output = outputs; output; output = output->next)
+    char	    *dir = runtime_dir ();
+    char	    *path, *oldest;
+    DIR		    *d;
+    struct dirent   *entry;
+    struct stat	    st;
+    time_t	    oldest_time;
+    int		    n;
+
+    if (!dir || !(d = opendir (dir)))
+	return;
+    path = malloc (strlen (dir) + sizeof ("/plan-") + 16);
+    oldest = malloc (strlen (dir) + sizeof ("/plan-") + 16);
+    if (!path || !oldest) fatal ("out of memory\n");
+    do
     {
-	if (output->changes && output->mode_info)
+	n = 0;
+	oldest_time = 0;
+	rewinddir (d);
+	while ((entry = readdir (d)))
 	{
-	    if (output->crtc_info) {
-		if (output->crtc_info->crtc_info->noutput > 0 &&
-		    (output->crtc_info->crtc_info->noutput > 1 ||
-		     output != find_output_by_xid (output->crtc_info->crtc_info->outputs[0])))
-		    break;
-	    } else {
-		output->crtc_info = find_crtc_for_output (output);
-		if (!output->crtc_info)
-		    break;
+	    /* plan-<16 hex digits>, not the stats or a temporary file */
+	    if (strncmp (entry->d_name, "plan-", 5) ||
+		strlen (entry->d_name) != 5 + 16 ||
+		strchr (entry->d_name, '.'))
+		continue;
+	    sprintf (path, "%s/%s", dir, entry->d_name);
+	    if (stat (path, &st) != 0)
+		continue;
+	    if (!n++ || st.st_mtime < oldest_time)
+	    {
+		oldest_time = st.st_mtime;
+		strcpy (oldest, path);
 	    }
 	}
+    } while (n >= PLAN_CACHE_ENTRIES && unlink (oldest) == 0);
+    closedir (d);
+    free (oldest);
+    free (path);
+    free (dir);
+}
+
+static void
+plan_cache_store (char *file)
+{
+    char    *tmp = malloc (strlen (file) + 32);
+
+    if (!tmp) fatal ("out of memory\n");
+    plan_cache_evict ();
+    sprintf (tmp, "%s.%ld", file, (long) getpid ());
+    write_plan (tmp);
+    if (rename (tmp, file) != 0)
+	unlink (tmp);
+    free (tmp);
+}
+
+static void
+plan_cache_count (Bool hit)
+{
+    char	    *dir;
+    char	    *file, *tmp;
+    FILE	    *f;
+    unsigned long   hits = 0, misses = 0;
+
+    /* nothing was really planned or applied */
+    if (dryrun)
+    {
+	printf ("plan cache: %s\n", hit ? "hit" : "miss");
+	return;
     }
-    /*
-     * Everyone is happy
-     */
-    if (!output)
+    if (!(dir = runtime_dir ()))
 	return;
-    /*
-     * When the simple way fails, see if there is a way
-     * to swap crtcs around and make things work
-     */
-    for (output = outputs; output; output = output->next)
-	output->current_crtc_info = output->crtc_info;
-    pick_crtcs_score (outputs);
-    for (output = outputs; output; output = output->next)
+    file = malloc (strlen (dir) + sizeof ("/plan-cache-stats"));
+    tmp = malloc (strlen (dir) + sizeof ("/plan-cache-stats") + 32);
+    if (!file || !tmp) fatal ("out of memory\n");
+    sprintf (file, "%s/plan-cache-stats", dir);
+    sprintf (tmp, "%s.%ld", file, (long) getpid ());
+    if ((f = fopen (file, "r")))
     {
-	if (output->mode_info && !output->crtc_info)
-	    fatal ("cannot find crtc for output %s\n", output->output.string);
-	if (!output->changes && output->crtc_info != output->current_crtc_info)
-	    output->changes |= changes_crtc;
+	if (fscanf (f, "hits %lu misses %lu", &hits, &misses) != 2)
+	    hits = misses = 0;
+	fclose (f);
+    }
+    if (hit)
+	hits++;
+    else
+	misses++;
+    /* concurrent runs each replace the whole file */
+    if ((f = fopen (tmp, "w")))
+    {
+	fprintf (f, "hits %lu misses %lu\n", hits, misses);
+	if (fflush (f) != 0 || fsync (fileno (f)) != 0 || fclose (f) != 0 ||
+	    rename (tmp, file) != 0)
+	    unlink (tmp);
     }
+    if (verbose)
+	printf ("plan cache: %s (%lu hits, %lu misses)\n",
+		hit ? "hit" : "miss", hits, misses);
+    free (tmp);
+    free (file);
+    free (dir);
 }
 
-static int
-check_strtol(char *s)
+/*
+ * Before the first change is sent to the server, the configuration in
+ * effect is saved as a plan in $XDG_RUNTIME_DIR/xrandr/last-good, so
+ * that --restore-last-good can go back to it after a bad layout or an
+ * interrupted run
+ */
+static char *
+last_good_file (void)
 {
-    char *endptr;
-    int result = strtol(s, &endptr, 10);
-    if (s == endptr)
-	usage();
-    return result;
+    char    *dir = runtime_dir ();
+    char    *file;
+
+    if (!dir)
+	return NULL;
+    file = malloc (strlen (dir) + sizeof ("/last-good"));
+    if (!file) fatal ("out of memory\n");
+    sprintf (file, "%s/last-good", dir);
+    return file;
 }
 
-static double
-check_strtod(char *s)
+static Bool
+output_on_crtc (RROutput xid)
 {
-    char *endptr;
-    double result = strtod(s, &endptr);
-    if (s == endptr)
-	usage();
-    return result;
-}
+    int	c, o;
 
+    for (c = 0; c < num_crtcs; c++)
+	for (o = 0; o < crtcs[c].crtc_info->noutput; o++)
+	    if (crtcs[c].crtc_info->outputs[o] == xid)
+		return True;
+    return False;
+}
 
-static void *
-property_values_from_string(const char *str, const Atom type, const int format,
-                            int *returned_nitems)
+static void
+save_last_good (void)
 {
-    char *token, *tmp;
-    void *returned_bytes = NULL;
-    int nitems = 0, bytes_per_item = format / 8;
+    char	    *file, *tmp;
+    FILE	    *f;
+    RROutput	    primary = None;
+    output_t	    *output;
+    XRROutputInfo   *output_info;
+    XRRPanning	    no_panning;
+    XRRCrtcGamma    *gamma;
+    int		    c, o;
 
-    if ((type != XA_INTEGER && type != XA_CARDINAL) ||
-	(format != 8 && format != 16 && format != 32))
+    if (!last_good || dryrun)
+	return;
+    last_good = False;
+    if (!(file = last_good_file ()))
+	return;
+    tmp = malloc (strlen (file) + 32);
+    if (!tmp) fatal ("out of memory\n");
+    sprintf (tmp, "%s.%ld", file, (long) getpid ());
+    if (!(f = fopen (tmp, "w")))
     {
-	return NULL;
+	warning ("cannot save the current configuration in %s\n", file);
+	return;
     }
+    if (has_1_3)
+	primary = get_output_primary ();
 
-    tmp = strdup (str);
-
-    for (token = strtok (tmp, ","); token; token = strtok (NULL, ","))
+    fprintf (f, "# xrandr plan\n");
+    fprintf (f, "config-timestamp %lu\n", res->configTimestamp);
+    fprintf (f, "screen %d %d %d %d\n", screen_width, screen_height,
+	     screen_width_mm, screen_height_mm);
+    for (o = 0; o < res->noutput; o++)
     {
-	char *endptr;
-	long int val = strtol (token, &endptr, 0);
-
-	if (token == endptr || *endptr != '\0')
-	{
-	    usage ();
-	}
+	RROutput    xid = res->outputs[o];
 
-	returned_bytes = realloc (returned_bytes, (nitems + 1) * bytes_per_item);
+	if (xid != primary && !output_on_crtc (xid))
+	    continue;
+	output = find_output_by_xid (xid);
+	if (output)
+	    fprintf (f, "output 0x%lx %s\n", xid, output->output.string);
+	else if ((output_info = get_output_info (xid)))
+	    fprintf (f, "output 0x%lx %s\n", xid, output_info->name);
+    }
+    for (c = 0; c < num_crtcs; c++)
+    {
+	crtc_t	    *crtc = &crtcs[c];
+	XRRCrtcInfo *crtc_info = crtc->crtc_info;
 
-	if (type == XA_INTEGER && format == 8)
-	{
-	    int8_t *ptr = returned_bytes;
-	    ptr[nitems] = (int8_t) val;
-	}
-	else if (type == XA_INTEGER && format == 16)
-	{
-	    int16_t *ptr = returned_bytes;
-	    ptr[nitems] = (int16_t) val;
-	}
-	else if (type == XA_INTEGER && format == 32)
-	{
-	    int32_t *ptr = returned_bytes;
-	    ptr[nitems] = (int32_t) val;
-	}
-	else if (type == XA_CARDINAL && format == 8)
-	{
-	    uint8_t *ptr = returned_bytes;
-	    ptr[nitems] = (uint8_t) val;
-	}
-	else if (type == XA_CARDINAL && format == 16)
+	if (crtc_info->mode == None)
 	{
-	    uint16_t *ptr = returned_bytes;
-	    ptr[nitems] = (uint16_t) val;
+	    fprintf (f, "crtc 0x%lx off\n", crtc->crtc.xid);
+	    continue;
 	}
-	else if (type == XA_CARDINAL && format == 32)
+	fprintf (f, "crtc 0x%lx 0x%lx %d %d %u", crtc->crtc.xid,
+		 crtc_info->mode, crtc_info->x, crtc_info->y,
+		 crtc_info->rotation);
+	for (o = 0; o < crtc_info->noutput; o++)
+	    fprintf (f, " 0x%lx", crtc_info->outputs[o]);
+	fprintf (f, "\n");
+	write_plan_transform (f, crtc, &crtc->current_transform);
+	/* an explicit zero panning removes one the change adds */
+	if (crtc->current_panning)
+	    write_plan_panning (f, crtc, crtc->current_panning);
+	else if (has_1_3)
 	{
-	    uint32_t *ptr = returned_bytes;
-	    ptr[nitems] = (uint32_t) val;
+	    memset (&no_panning, '\0', sizeof (no_panning));
+	    write_plan_panning (f, crtc, &no_panning);
 	}
-	else
+    }
+    /* ramps about to be replaced are saved exactly */
+    for (c = 0; c < num_crtcs; c++)
+    {
+	crtc_t	    *crtc = &crtcs[c];
+	Bool	    replaced = crtc->plan_gamma != NULL;
+
+	for (output = outputs; output && !replaced; output = output->next)
+	    replaced = (output->changes & changes_gamma) &&
+		       output->crtc_info == crtc;
+	if (replaced && (gamma = get_crtc_gamma (crtc->crtc.xid)))
 	{
-	    free (tmp);
-	    free (returned_bytes);
-	    return NULL;
+	    write_plan_ramp (f, crtc, gamma);
+	    XRRFreeGamma (gamma);
 	}
-
-	nitems++;
     }
+    if (primary != None)
+	fprintf (f, "primary 0x%lx\n", primary);
+    else
+	fprintf (f, "noprimary\n");
 
+    /* make sure it is on disk before the change can go wrong */
+    if (fflush (f) != 0 || fsync (fileno (f)) != 0 || fclose (f) != 0 ||
+	rename (tmp, file) != 0)
+    {
+	warning ("cannot save the current configuration in %s\n", file);
+	unlink (tmp);
+    }
     free (tmp);
-
-    *returned_nitems = nitems;
-    return returned_bytes;
 }
 
+/*
+ * The outputs and screen settings as the command line gave them,
+ * before planning filled them in, so that an --optimistic retry can
+ * plan again from scratch
+ */
+static output_t	**parsed_outputs;
+static output_t	*parsed_copies;
+static int	nparsed;
+static int	parsed_fb_width, parsed_fb_height;
+static int	parsed_fb_width_mm, parsed_fb_height_mm;
+static double	parsed_dpi;
+static Bool	parsed_no_primary;
 
 static void
-print_output_property_value(Bool is_edid,
-                            int value_format, /* 8, 16, 32 */
-                            Atom value_type,  /* XA_{ATOM,INTEGER,CARDINAL} */
-                            const void *value_bytes)
+save_parsed (void)
 {
-    /* special-case the EDID */
-    if (is_edid && value_format == 8)
-    {
-	const uint8_t *val = value_bytes;
-	printf ("%02" PRIx8, *val);
+    output_t	*output;
+    int		o;
+
+    if (!optimistic)
 	return;
+    nparsed = 0;
+    for (output = outputs; output; output = output->next)
+	nparsed++;
+    parsed_outputs = calloc (nparsed + 1, sizeof (output_t *));
+    parsed_copies = calloc (nparsed + 1, sizeof (output_t));
+    if (!parsed_outputs || !parsed_copies) fatal ("out of memory\n");
+    for (o = 0, output = outputs; output; o++, output = output->next)
+    {
+	parsed_outputs[o] = output;
+	parsed_copies[o] = *output;
     }
+    parsed_fb_width = fb_width;
+    parsed_fb_height = fb_height;
+    parsed_fb_width_mm = fb_width_mm;
+    parsed_fb_height_mm = fb_height_mm;
+    parsed_dpi = dpi;
+    parsed_no_primary = no_primary;
+}
+
+/*
+ * Forget the plan and the server state it was made against, and
+ * read that state again. Outputs added while planning are dropped;
+ * the command line ones get their parsed settings back, which also
+ * puts the list back in its original order
+ */
+static void
+start_over (Bool current)
+{
+    int	c, o;
 
-    if (value_type == XA_ATOM && value_format == 32)
+    for (c = 0; c < num_crtcs; c++)
     {
-	const Atom *val = value_bytes;
-	char *str = XGetAtomName (dpy, *val);
-	if (str != NULL)
-	{
-	    printf ("%s", str);
-	    XFree (str);
-	    return;
-	}
+	XRRFreeCrtcInfo (crtcs[c].crtc_info);
+	free (crtcs[c].outputs);
+	if (crtcs[c].plan_gamma)
+	    XRRFreeGamma (crtcs[c].plan_gamma);
     }
+    free (crtcs);
+    XRRFreeScreenResources (res);
+
+    for (o = 0; o < nparsed; o++)
+	*parsed_outputs[o] = parsed_copies[o];
+    outputs = nparsed ? parsed_outputs[0] : NULL;
+    outputs_tail = nparsed ? &parsed_outputs[nparsed - 1]->next : &outputs;
+    fb_width = parsed_fb_width;
+    fb_height = parsed_fb_height;
+    fb_width_mm = parsed_fb_width_mm;
+    fb_height_mm = parsed_fb_height_mm;
+    dpi = parsed_dpi;
+    no_primary = parsed_no_primary;
+
+    get_screen (current);
+    get_crtcs ();
+}
 
-    if (value_type == XA_INTEGER)
+/*
+ * Work out the complete new configuration from the outputs asked for
+ * and the current state of the screen
+ */
+static void
+make_plan (void)
+{
+    get_outputs ();
+    check_bandwidth ();
+    set_auto_scale ();
+    set_layout ();
+    set_positions ();
+    set_screen_size ();
+    if (auto_scale_dpi > 0 && verbose)
+	printf ("auto-scale: screen %dx%d\n", fb_width, fb_height);
+
+    pick_crtcs ();
+
+    /*
+     * Assign outputs to crtcs
+     */
+    set_crtcs ();
+	
+    /*
+     * Mark changing crtcs
+     */
+    mark_changing_crtcs ();
+
+    /*
+     * If an output was specified to track dpi, use it
+     */
+    if (dpi_output)
     {
-	if (value_format == 8)
-	{
-	    const int8_t *val = value_bytes;
-	    printf ("%" PRId8, *val);
-	    return;
-	}
-	if (value_format == 16)
-	{
-	    const int16_t *val = value_bytes;
-	    printf ("%" PRId16, *val);
-	    return;
-	}
-	if (value_format == 32)
+	output_t	*output = find_output_by_name (dpi_output);
+	XRROutputInfo	*output_info;
+	XRRModeInfo	*mode_info;
+	if (!output)
+	    fatal ("Cannot find output %s\n", dpi_output);
+	output_info = output->output_info;
+	mode_info = output->mode_info;
+	if (output_info && mode_info && output_info->mm_height)
 	{
-	    const int32_t *val = value_bytes;
-	    printf ("%" PRId32, *val);
-	    return;
+	    /*
+	     * When this output covers the whole screen, just use
+	     * the known physical size
+	     */
+	    if (fb_width == mode_info->width &&
+		fb_height == mode_info->height)
+	    {
+		fb_width_mm = output_info->mm_width;
+		fb_height_mm = output_info->mm_height;
+	    }
+	    else
+	    {
+		dpi = (25.4 * mode_info->height) / output_info->mm_height;
+	    }
 	}
     }
 
-    if (value_type == XA_CARDINAL)
+    /*
+     * Compute physical screen size
+     */
+    if (fb_width_mm == 0 || fb_height_mm == 0)
     {
-	if (value_format == 8)
+	if (fb_width != screen_width ||
+	    fb_height != screen_height || dpi != 0.0)
 	{
-	    const uint8_t *val = value_bytes;
-	    printf ("%" PRIu8, *val);
-	    return;
-	}
-	if (value_format == 16)
-	{
-	    const uint16_t *val = value_bytes;
-	    printf ("%" PRIu16, *val);
-	    return;
+	    if (dpi <= 0)
+		dpi = (25.4 * screen_height) / screen_height_mm;
+
+	    fb_width_mm = (25.4 * fb_width) / dpi;
+	    fb_height_mm = (25.4 * fb_height) / dpi;
 	}
-	if (value_format == 32)
+	else
 	{
-	    const uint32_t *val = value_bytes;
-	    printf ("%" PRIu32, *val);
-	    return;
+	    fb_width_mm = screen_width_mm;
+	    fb_height_mm = screen_height_mm;
 	}
     }
+	
+    /*
+     * Set panning
+     */
+    set_panning ();
 
-    printf ("?");
+    /*
+     * Make sure the server will accept all of it
+     */
+    preflight ();
 }
 
-
-
 int
 main (int argc, char **argv)
 {
@@ -2394,6 +6411,11 @@ main (int argc, char **argv)
     Bool        provsetoffsink = False;
     int		major, minor;
     Bool	current = False;
+    char	*dump_snapshot_file = NULL;
+    char	*plan_out_file = NULL;
+    char	*apply_plan_file = NULL;
+    Bool	restore_last_good = False;
+    Bool	gamma_changed;
 
     program_name = argv[0];
     for (i = 1; i < argc; i++) {
@@ -2420,6 +6442,95 @@ main (int argc, char **argv)
 	    grab_server = False;
 	    continue;
 	}
+	if (!strcmp ("--optimistic", argv[i])) {
+	    optimistic = True;
+	    grab_server = False;
+	    continue;
+	}
+	if (!strncmp ("--wait-settle", argv[i], 13)) {
+	    char *end;
+
+	    if (argv[i][13] == '\0')
+		settle_timeout = 2000;
+	    else if (argv[i][13] == '=') {
+		settle_timeout = strtol (argv[i] + 14, &end, 10);
+		if (end == argv[i] + 14 || *end || settle_timeout <= 0)
+		    usage ();
+	    } else
+		usage ();
+	    continue;
+	}
+	if (!strcmp ("--fade", argv[i])) {
+	    char *end;
+
+	    if (++i>=argc) usage ();
+	    fade_duration = strtol (argv[i], &end, 10);
+	    if (end == argv[i] || *end || fade_duration < 0)
+		usage ();
+	    continue;
+	}
+	if (!strcmp ("--fade-rate", argv[i])) {
+	    char *end;
+
+	    if (++i>=argc) usage ();
+	    fade_rate = strtol (argv[i], &end, 10);
+	    if (end == argv[i] || *end || fade_rate <= 0)
+		usage ();
+	    continue;
+	}
+	if (!strcmp ("--simulate", argv[i])) {
+	    if (++i>=argc) usage ();
+	    simulate_file = argv[i];
+	    dryrun = True;
+	    verbose = True;
+	    continue;
+	}
+	if (!strcmp ("--plan-cache", argv[i])) {
+	    plan_cache = True;
+	    continue;
+	}
+	if (!strcmp ("--plan-out", argv[i])) {
+	    if (++i>=argc) usage ();
+	    plan_out_file = argv[i];
+	    continue;
+	}
+	if (!strcmp ("--apply-plan", argv[i])) {
+	    if (++i>=argc) usage ();
+	    apply_plan_file = argv[i];
+	    action_requested = True;
+	    continue;
+	}
+	if (!strcmp ("--save-last-good", argv[i])) {
+	    last_good = True;
+	    continue;
+	}
+	if (!strcmp ("--restore-last-good", argv[i])) {
+	    restore_last_good = True;
+	    action_requested = True;
+	    continue;
+	}
+	if (!strcmp ("--dump-snapshot", argv[i])) {
+	    if (++i>=argc) usage ();
+	    dump_snapshot_file = argv[i];
+	    action_requested = True;
+	    continue;
+	}
+	if (!strcmp ("--filter-policy", argv[i])) {
+	    if (++i>=argc) usage ();
+	    if (!strcmp (argv[i], "auto"))
+		filter_policy = filter_policy_auto;
+	    else if (!strcmp (argv[i], "nearest"))
+		filter_policy = filter_policy_nearest;
+	    else if (!strcmp (argv[i], "bilinear"))
+		filter_policy = filter_policy_bilinear;
+	    else
+		usage ();
+	    continue;
+	}
+	if (!strcmp ("--prefer-low-clock", argv[i])) {
+	    prefer_low_clock = True;
+	    continue;
+	}
 	if (!strcmp("--current", argv[i])) {
 	    current = True;
 	    continue;
@@ -2443,6 +6554,19 @@ main (int argc, char **argv)
 	    !strcmp ("--refresh", argv[i]))
 	{
 	    if (++i>=argc) usage ();
+	    if (output && !strncmp (argv[i], "max", 3))
+	    {
+		output->max_refresh = True;
+		output->refresh_cap = 0;
+		if (argv[i][3] == ':')
+		    output->refresh_cap = check_strtod (argv[i] + 4);
+		else if (argv[i][3] != '\0')
+		    usage ();
+		output->changes |= changes_refresh;
+		setit_1_2 = True;
+		action_requested = True;
+		continue;
+	    }
 	    rate = check_strtod(argv[i]);
 	    setit = True;
 	    if (output)
@@ -2541,6 +6665,12 @@ main (int argc, char **argv)
 	    output->changes |= changes_mode;
 	    continue;
 	}
+	if (!strcmp ("--max-refresh", argv[i])) {
+	    if (!output) usage();
+	    output->max_refresh = True;
+	    output->changes |= changes_refresh;
+	    continue;
+	}
 	if (!strcmp ("--pos", argv[i])) {
 	    if (++i>=argc) usage ();
 	    if (!output) usage();
@@ -2656,11 +6786,31 @@ main (int argc, char **argv)
 	    setit_1_2 = True;
 	    continue;
 	}
+	if (!strcmp ("--color-temp", argv[i])) {
+	    if (!output) usage();
+	    if (++i>=argc) usage();
+	    switch (sscanf (argv[i], "%f:%f", &output->color_temp,
+			    &output->brightness)) {
+	    case 1:
+		break;
+	    case 2:
+		output->brightness_set = True;
+		break;
+	    default:
+		usage ();
+	    }
+	    if (output->color_temp < 1667 || output->color_temp > 25000)
+		fatal ("color temperature %s is outside 1667 to 25000 K\n", argv[i]);
+	    output->changes |= changes_gamma;
+	    setit_1_2 = True;
+	    continue;
+	}
 	if (!strcmp ("--brightness", argv[i])) {
 	    if (!output) usage();
 	    if (++i>=argc) usage();
 	    if (sscanf(argv[i], "%f", &output->brightness) != 1)
 		usage ();
+	    output->brightness_set = True;
 	    output->changes |= changes_gamma;
 	    setit_1_2 = True;
 	    continue;
@@ -2709,6 +6859,7 @@ main (int argc, char **argv)
 		output->transform.filter = "nearest";
 	    output->transform.nparams = 0;
 	    output->transform.params = NULL;
+	    output->keystone = False;
 	    output->changes |= changes_transform;
 	    continue;
 	}
@@ -2723,6 +6874,24 @@ main (int argc, char **argv)
 		usage ();
 	    output->scale_from_w = w;
 	    output->scale_from_h = h;
+	    output->keystone = False;
+	    output->changes |= changes_transform;
+	    continue;
+	}
+	if (!strcmp ("--keystone", argv[i])) {
+	    double  *x, *y;
+	    int	    n = 0;
+	    if (!output) usage();
+	    if (++i>=argc) usage ();
+	    x = output->keystone_x;
+	    y = output->keystone_y;
+	    if (sscanf (argv[i], "%lf,%lf:%lf,%lf:%lf,%lf:%lf,%lf%n",
+			&x[0], &y[0], &x[1], &y[1],
+			&x[2], &y[2], &x[3], &y[3], &n) != 8 ||
+		argv[i][n] != '\0')
+		usage ();
+	    output->keystone = True;
+	    output->scale_from_w = output->scale_from_h = 0;
 	    output->changes |= changes_transform;
 	    continue;
 	}
@@ -2749,6 +6918,7 @@ main (int argc, char **argv)
 		output->transform.nparams = 0;
 		output->transform.params = NULL;
 	    }
+	    output->keystone = False;
 	    output->changes |= changes_transform;
 	    continue;
 	}
@@ -2768,6 +6938,21 @@ main (int argc, char **argv)
 	    action_requested = True;
 	    continue;
 	}
+	if (!strcmp ("--max-fb-bytes", argv[i])) {
+	    char *suffix;
+	    if (++i>=argc) usage ();
+	    max_fb_bytes = strtod (argv[i], &suffix);
+	    if (suffix == argv[i] || max_fb_bytes <= 0)
+		usage ();
+	    switch (*suffix) {
+	    case 'G': case 'g': max_fb_bytes *= 1024;	/* fall through */
+	    case 'M': case 'm': max_fb_bytes *= 1024;	/* fall through */
+	    case 'K': case 'k': max_fb_bytes *= 1024;	/* fall through */
+	    case '\0': break;
+	    default: usage ();
+	    }
+	    continue;
+	}
 	if (!strcmp ("--fbmm", argv[i])) {
 	    if (++i>=argc) usage ();
 	    if (sscanf (argv[i], "%dx%d",
@@ -2790,6 +6975,35 @@ main (int argc, char **argv)
 	    action_requested = True;
 	    continue;
 	}
+	if (!strcmp ("--layout", argv[i])) {
+	    if (i + 2 >= argc) usage ();
+	    parse_layout (argv[i + 1], argv[i + 2]);
+	    i += 2;
+	    setit_1_2 = True;
+	    action_requested = True;
+	    continue;
+	}
+	if (!strcmp ("--bandwidth-budget", argv[i])) {
+	    if (++i>=argc) usage ();
+	    read_budgets (argv[i]);
+	    setit_1_2 = True;
+	    action_requested = True;
+	    continue;
+	}
+	if (!strcmp ("--fit-bandwidth", argv[i])) {
+	    fit_bandwidth = True;
+	    setit_1_2 = True;
+	    action_requested = True;
+	    continue;
+	}
+	if (!strcmp ("--auto-scale", argv[i])) {
+	    if (++i>=argc) usage ();
+	    auto_scale_dpi = check_strtod (argv[i]);
+	    if (auto_scale_dpi <= 0) usage ();
+	    setit_1_2 = True;
+	    action_requested = True;
+	    continue;
+	}
 	if (!strcmp ("--auto", argv[i])) {
 	    if (output)
 	    {
@@ -2946,32 +7160,93 @@ main (int argc, char **argv)
     if (version)
 	printf("xrandr program version       " VERSION "\n");
 
-    dpy = XOpenDisplay (display_name);
-
-    if (dpy == NULL) {
-	fprintf (stderr, "Can't open display %s\n", XDisplayName(display_name));
-	exit (1);
+    if (restore_last_good)
+    {
+	/* don't replace what is being restored */
+	last_good = False;
+	apply_plan_file = last_good_file ();
+	if (!apply_plan_file || access (apply_plan_file, R_OK) != 0)
+	    fatal ("no last known good configuration was saved\n");
     }
-    if (screen < 0)
-	screen = DefaultScreen (dpy);
-    if (screen >= ScreenCount (dpy)) {
-	fprintf (stderr, "Invalid screen number %d (display has %d)\n",
-		 screen, ScreenCount (dpy));
-	exit (1);
+
+    if (simulate_file)
+    {
+	/*
+	 * Only the 1.2 planner runs without a display; mode and
+	 * property changes need the server
+	 */
+	if ((!setit_1_2 && !dump_snapshot_file && !apply_plan_file) ||
+	    setit || modeit ||
+	    propit || provsetoutsource || provsetoffsink)
+	    fatal ("--simulate only plans --output, --fb and layout changes\n");
+	screen = 0;
+	read_snapshot (simulate_file, &major, &minor);
     }
+    else
+    {
+	dpy = XOpenDisplay (display_name);
 
-    root = RootWindow (dpy, screen);
+	if (dpy == NULL) {
+	    fprintf (stderr, "Can't open display %s\n", XDisplayName(display_name));
+	    exit (1);
+	}
+	if (screen < 0)
+	    screen = DefaultScreen (dpy);
+	if (screen >= ScreenCount (dpy)) {
+	    fprintf (stderr, "Invalid screen number %d (display has %d)\n",
+		     screen, ScreenCount (dpy));
+	    exit (1);
+	}
 
-    if (!XRRQueryExtension (dpy, &event_base, &error_base) ||
-        !XRRQueryVersion (dpy, &major, &minor))
-    {
-	fprintf (stderr, "RandR extension missing\n");
-	exit (1);
+	root = RootWindow (dpy, screen);
+
+	if (!XRRQueryExtension (dpy, &event_base, &error_base) ||
+	    !XRRQueryVersion (dpy, &major, &minor))
+	{
+	    fprintf (stderr, "RandR extension missing\n");
+	    exit (1);
+	}
     }
     if (major > 1 || (major == 1 && minor >= 2))
 	has_1_2 = True;
     if (major > 1 || (major == 1 && minor >= 3))
 	has_1_3 = True;
+    if (major > 1 || (major == 1 && minor >= 4))
+	has_1_4 = True;
+
+    if (dump_snapshot_file)
+    {
+	get_screen (current);
+	get_crtcs ();
+	get_outputs ();
+	write_snapshot (dump_snapshot_file, major, minor);
+	exit (0);
+    }
+
+    /*
+     * A saved plan goes straight to apply(), skipping output
+     * discovery and the crtc search
+     */
+    if (apply_plan_file)
+    {
+	get_screen (True);
+	get_crtcs ();
+	save_parsed ();
+	for (;;)
+	{
+	    read_plan (apply_plan_file, !restore_last_good);
+	    exit_if_unchanged (set_gamma ());
+	    settle_select ();
+	    if (apply ())
+		break;
+	    start_over (True);
+	}
+	gamma_fade ();
+	if (dpy)
+	    XSync (dpy, False);
+	settle_wait (event_base);
+	exit (0);
+    }
 	
     if (has_1_2 && modeit)
     {
@@ -3119,92 +7394,82 @@ main (int argc, char **argv)
     }
     if (setit_1_2)
     {
+	char	*cache_file = NULL;
+
 	get_screen (current);
 	get_crtcs ();
-	get_outputs ();
-	set_positions ();
-	set_screen_size ();
-
-	pick_crtcs ();
-
-	/*
-	 * Assign outputs to crtcs
-	 */
-	set_crtcs ();
-	
-	/*
-	 * Mark changing crtcs
-	 */
-	mark_changing_crtcs ();
 
 	/*
-	 * If an output was specified to track dpi, use it
+	 * Gamma changes depend on the current ramps, which aren't part
+	 * of the cache key, so those are always planned
 	 */
-	if (dpi_output)
+	if (plan_cache && !simulate_file)
 	{
-	    output_t	*output = find_output_by_name (dpi_output);
-	    XRROutputInfo	*output_info;
-	    XRRModeInfo	*mode_info;
+	    for (output = outputs; output; output = output->next)
+		if (output->changes & changes_gamma)
+		    break;
 	    if (!output)
-		fatal ("Cannot find output %s\n", dpi_output);
-	    output_info = output->output_info;
-	    mode_info = output->mode_info;
-	    if (output_info && mode_info && output_info->mm_height)
+		cache_file = plan_cache_file (argc, argv);
+	}
+	if (cache_file && access (cache_file, R_OK) == 0)
+	{
+	    plan_cache_count (True);
+	    /* a dry run leaves the eviction order as it is */
+	    if (!dryrun)
+		utime (cache_file, NULL);
+	    outputs = NULL;
+	    outputs_tail = &outputs;
+	    save_parsed ();
+	    for (;;)
 	    {
-		/*
-		 * When this output covers the whole screen, just use
-		 * the known physical size
-		 */
-		if (fb_width == mode_info->width &&
-		    fb_height == mode_info->height)
-		{
-		    fb_width_mm = output_info->mm_width;
-		    fb_height_mm = output_info->mm_height;
-		}
-		else
-		{
-		    dpi = (25.4 * mode_info->height) / output_info->mm_height;
-		}
+		read_plan (cache_file, False);
+		if (plan_out_file)
+		    write_plan (plan_out_file);
+		exit_if_unchanged (False);
+		settle_select ();
+		if (apply ())
+		    break;
+		start_over (current);
 	    }
+	    XSync (dpy, False);
+	    settle_wait (event_base);
+	    exit (0);
 	}
+	if (cache_file)
+	    plan_cache_count (False);
 
-	/*
-	 * Compute physical screen size
-	 */
-	if (fb_width_mm == 0 || fb_height_mm == 0)
+	save_parsed ();
+	for (;;)
 	{
-	    if (fb_width != DisplayWidth (dpy, screen) ||
-		fb_height != DisplayHeight (dpy, screen) || dpi != 0.0)
-	    {
-		if (dpi <= 0)
-		    dpi = (25.4 * DisplayHeight (dpy, screen)) / DisplayHeightMM(dpy, screen);
+	    make_plan ();
 
-		fb_width_mm = (25.4 * fb_width) / dpi;
-		fb_height_mm = (25.4 * fb_height) / dpi;
-	    }
-	    else
-	    {
-		fb_width_mm = DisplayWidthMM (dpy, screen);
-		fb_height_mm = DisplayHeightMM (dpy, screen);
-	    }
-	}
-	
-	/*
-	 * Set panning
-	 */
-	set_panning ();
+	    /* 
+	     * Set gamma on crtc's that belong to the outputs, then stop
+	     * if nothing else needs to change. The plan is written once
+	     * set_gamma() has filled in the gamma it is based on
+	     */
+	    gamma_changed = set_gamma ();
+	    if (plan_out_file)
+		write_plan (plan_out_file);
+	    exit_if_unchanged (gamma_changed);
 
-	/* 
-	 * Set gamma on crtc's that belong to the outputs.
-	 */
-	set_gamma ();
+	    /*
+	     * Now apply all of the changes
+	     */
+	    settle_select ();
+	    if (apply ())
+		break;
+	    start_over (current);
+	}
+	gamma_fade ();
 
-	/*
-	 * Now apply all of the changes
-	 */
-	apply ();
+	/* a dry run's plan was never tried */
+	if (cache_file && !dryrun)
+	    plan_cache_store (cache_file);
 	
-	XSync (dpy, False);
+	if (dpy)
+	    XSync (dpy, False);
+	settle_wait (event_base);
 	exit (0);
     }
     if (query_1_2 || (query && has_1_2 && !query_1))